@@ -0,0 +1,139 @@
+/*
+ * arena.c
+ *
+ * Bump allocation out of large chunks.  Small objects (SNP and probe
+ * nodes, names, IDs) are packed into ARENA_CHUNK_SIZE chunks with no
+ * per-object header; anything over a quarter of a chunk (genotype
+ * matrices, expression values) gets a chunk of its own.  Nothing is freed
+ * individually: arena_free releases every chunk at once, and chunks are
+ * counted against the arena's mem.h category as they come and go.
+ * Allocation takes a lock so parser threads can share an arena.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "arena.h"
+#include "mem.h"
+
+#define ARENA_ALIGN 16
+
+typedef struct _arena_chunk_t {
+  struct _arena_chunk_t *next;
+  char *base;
+  size_t size;
+  size_t used;
+  int mapped;                   /* An adopted mapping, to munmap */
+} arena_chunk_t;
+
+/* Chunk data starts this far past the chunk header */
+#define ARENA_HEADER ((sizeof(arena_chunk_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct _arena_t {
+  arena_chunk_t *chunks;        /* All chunks, newest first */
+  arena_chunk_t *cur;           /* Chunk small objects come from */
+  int category;
+  pthread_mutex_t lock;
+};
+
+arena_t *arena_new (int category) {
+  arena_t *a;
+
+  a = MallocOrDie(sizeof(arena_t));
+  a->chunks = NULL;
+  a->cur = NULL;
+  a->category = category;
+  pthread_mutex_init (&a->lock, NULL);
+  return(a);
+}
+
+/* Called with the lock held; the caller tracks the chunk after
+   unlocking, since going over --mem-limit can unwind */
+static arena_chunk_t *arena_chunk (arena_t *a, size_t size) {
+  arena_chunk_t *c;
+
+  c = MallocOrDie(ARENA_HEADER + size);
+  c->base = (char *)c + ARENA_HEADER;
+  c->size = size;
+  c->used = 0;
+  c->mapped = 0;
+  c->next = a->chunks;
+  a->chunks = c;
+  return(c);
+}
+
+/* Uninitialized, 16-byte aligned */
+void *arena_alloc (arena_t *a, size_t size) {
+  arena_chunk_t *c;
+  size_t added = 0;
+  void *p;
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  pthread_mutex_lock (&a->lock);
+  if (size > ARENA_CHUNK_SIZE/4) {
+    c = arena_chunk (a, size);
+    c->used = size;
+    p = c->base;
+    added = ARENA_HEADER + size;
+  } else {
+    if (a->cur == NULL || a->cur->used + size > a->cur->size) {
+      a->cur = arena_chunk (a, ARENA_CHUNK_SIZE);
+      added = ARENA_HEADER + ARENA_CHUNK_SIZE;
+    }
+    p = a->cur->base + a->cur->used;
+    a->cur->used += size;
+  }
+  pthread_mutex_unlock (&a->lock);
+  if (added > 0) mem_track (a->category, (long long)added);
+  return(p);
+}
+
+/* Copy of the first len chars of s, NUL terminated */
+char *arena_strndup (arena_t *a, char *s, size_t len) {
+  char *cp;
+
+  cp = arena_alloc(a, len + 1);
+  memcpy (cp, s, len);
+  cp[len] = '\0';
+  return(cp);
+}
+
+/* Makes a mapping part of the arena, to be unmapped by arena_free */
+void arena_add_mapping (arena_t *a, void *base, size_t size) {
+  arena_chunk_t *c;
+
+  c = MallocOrDie(sizeof(arena_chunk_t));
+  c->base = base;
+  c->size = size;
+  c->used = size;
+  c->mapped = 1;
+  pthread_mutex_lock (&a->lock);
+  c->next = a->chunks;
+  a->chunks = c;
+  pthread_mutex_unlock (&a->lock);
+  mem_track (a->category, (long long)size);
+}
+
+void arena_free (arena_t *a) {
+  arena_chunk_t *c, *next;
+
+  if (a == NULL) return;
+  for (c = a->chunks; c != NULL; c = next) {
+    next = c->next;
+    if (c->mapped) {
+      munmap (c->base, c->size);
+      mem_track (a->category, -(long long)c->size);
+    } else {
+      mem_track (a->category, -(long long)(ARENA_HEADER + c->size));
+    }
+    free(c);
+  }
+  pthread_mutex_destroy (&a->lock);
+  free(a);
+}
@@ -0,0 +1,27 @@
+/*
+ * arena.h
+ *
+ * Region allocation for load-time objects: everything read for a panel or
+ * a dataset comes out of one arena and goes away with one arena_free.
+ */
+
+#ifndef _arena_h
+#define _arena_h
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE (1 << 20)     /* Chunk small objects are packed into */
+
+typedef struct _arena_t arena_t;
+
+arena_t *arena_new (int category);
+
+void *arena_alloc (arena_t *a, size_t size);
+
+char *arena_strndup (arena_t *a, char *s, size_t len);
+
+void arena_add_mapping (arena_t *a, void *base, size_t size);
+
+void arena_free (arena_t *a);
+
+#endif
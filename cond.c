@@ -0,0 +1,332 @@
+/*
+ * cond.c
+ *
+ * Forward stepwise conditional cis-eQTL analysis.  For each probe, the
+ * best cis SNP is taken as a lead if it passes the threshold; the
+ * expression is then residualized on the leads so far and the window is
+ * scanned again, until nothing passes.
+ *
+ * The leads are kept as an orthonormal basis (plus the intercept, by
+ * centering).  Adding a lead is a rank-one update: one Gram-Schmidt step
+ * against the residual expression and against each remaining candidate's
+ * residual genotype vector, so a step costs one pass over the window
+ * rather than a refit of every candidate model.  For regression, the
+ * partial correlation of residual genotype with residual expression gives
+ * the exact conditional test (Frisch-Waugh); for K-W the residual
+ * expression is tested against the genotype groups.  Missing genotypes
+ * are mean-imputed in the conditional steps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <gsl/gsl_cdf.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "structs.h"
+#include "cond.h"
+#include "scan.h"
+#include "nonparam.h"
+#include "regress.h"
+#include "mem.h"
+#include "error.h"
+
+/* Shared state for the whole scan */
+typedef struct _cond_work_t {
+  phen_t **phens;
+  int num_phens;
+  snp_t **index;                /* Tested SNPs, sorted by position */
+  int num_snps;
+  int num_indivs;
+  int test_type;
+  int maxdist;
+  double threshold;
+  cond_hit_t **hits;            /* Per probe, in step order */
+  int *num_hits;
+  int next_phen;
+  char error[256];              /* First Fail() in a worker */
+  pthread_mutex_t lock;
+} cond_work_t;
+
+typedef struct _cond_worker_t {
+  cond_work_t *work;
+  snp_t **win;                  /* Cis window of the current probe */
+  int max_win;
+  double *gres;                 /* Residual genotype vectors, win x n */
+  double *gss;                  /* Their sums of squares */
+  char *selected;
+  double *y_res;
+  float *y_res_f;
+  int *order;                   /* K-W: the expression tested, in value order */
+  int *tie_counts;
+} cond_worker_t;
+
+static double dot (double *a, double *b, int n) {
+  double s = 0.;
+  int i;
+
+  for (i=0; i<n; i++) s += a[i]*b[i];
+  return(s);
+}
+
+/* Genotype vector minus its mean, missing calls set to the mean */
+static void center_gt (snp_t *snp, double *out, int n) {
+  double mean = 0.;
+  int i, m = 0;
+
+  for (i=0; i<n; i++) {
+    if (snp->gt[i] != 127) {
+      mean += snp->gt[i];
+      m++;
+    }
+  }
+  if (m > 0) mean /= m;
+  for (i=0; i<n; i++) {
+    out[i] = (snp->gt[i] != 127) ? snp->gt[i] - mean : 0.;
+  }
+}
+
+/* P for window SNP j at this step, having conditioned on k leads */
+static double cond_test (cond_worker_t *w, phen_t *phen, int j, int k) {
+  cond_work_t *work = w->work;
+  snp_t *snp = w->win[j];
+  int n = work->num_indivs;
+  double *g = w->gres + (size_t)j*n;
+  double yss, r, t, df;
+  int flag;
+
+  if (work->test_type == 0) {
+    return((float)nonparam_compar (k == 0 ? phen->values : w->y_res_f, snp->gt, n, snp->num_groups,
+				   w->order, w->tie_counts, &flag, NULL));
+  }
+  if (k == 0) {
+    return(regression_significance (snp->gt, phen->values, n));
+  }
+
+  yss = dot(w->y_res, w->y_res, n);
+  df = n - 2 - k;
+  if (w->gss[j] <= 1e-8 || yss <= 0. || df < 1.) return(1.);
+  r = dot(g, w->y_res, n) / sqrt(w->gss[j]*yss);
+  if (r*r >= 1.) return(0.);
+  t = r*sqrt(df/(1. - r*r));
+  return(2*gsl_cdf_tdist_Q(fabs(t), df));
+}
+
+static void add_hit (cond_work_t *work, int p, snp_t *snp, double pval, int step) {
+  cond_hit_t *hit;
+
+  work->hits[p] = ReallocOrDie(work->hits[p], sizeof(cond_hit_t)*(work->num_hits[p]+1));
+  hit = &work->hits[p][work->num_hits[p]++];
+  hit->snp = snp;
+  hit->phen = work->phens[p];
+  hit->p = pval;
+  hit->step = step;
+}
+
+static void cond_probe (cond_worker_t *w, int p) {
+  cond_work_t *work = w->work;
+  phen_t *phen = work->phens[p];
+  int n = work->num_indivs;
+  snp_t *snp;
+  int lo, hi, k, j, best, num_win, i;
+  double pval, best_p, mean, c, norm;
+  double *q, *g;
+
+  /* Gather the cis window */
+  num_win = 0;
+  lo = (phen->start < phen->stop ? phen->start : phen->stop) - work->maxdist;
+  hi = (phen->start < phen->stop ? phen->stop : phen->start) + work->maxdist;
+  for (k = cis_lower_bound(work->index, work->num_snps, phen->chr, lo); k < work->num_snps; k++) {
+    snp = work->index[k];
+    if (snp->chr != phen->chr || snp->pos > hi) break;
+    if (!check_cis(snp, phen, work->maxdist)) continue;
+    if (num_win == w->max_win) {
+      w->max_win = 2*w->max_win + 16;
+      w->win = ReallocOrDie(w->win, sizeof(snp_t *)*w->max_win);
+      mem_free(w->gres);       /* Refilled below */
+      w->gres = NULL;
+      w->gres = mem_alloc(MEM_SCRATCH, sizeof(double)*w->max_win*n);
+      w->gss = ReallocOrDie(w->gss, sizeof(double)*w->max_win);
+      w->selected = ReallocOrDie(w->selected, sizeof(char)*w->max_win);
+    }
+    w->win[num_win++] = snp;
+  }
+  if (num_win == 0) return;
+
+  mean = 0.;
+  for (i=0; i<n; i++) mean += phen->values[i];
+  mean /= n;
+  for (i=0; i<n; i++) w->y_res[i] = phen->values[i] - mean;
+  if (work->test_type == 0) nonparam_order (phen->values, n, w->order);
+  for (j=0; j<num_win; j++) {
+    g = w->gres + (size_t)j*n;
+    center_gt (w->win[j], g, n);
+    w->gss[j] = dot(g, g, n);
+    w->selected[j] = 0;
+  }
+
+  for (k=0; k < num_win && n - 3 - k > 0; k++) {
+    best = -1;
+    best_p = 2.;
+    for (j=0; j<num_win; j++) {
+      if (w->selected[j]) continue;
+      pval = cond_test (w, phen, j, k);
+      if (pval < best_p) {
+	best_p = pval;
+	best = j;
+      }
+    }
+    if (best < 0 || best_p >= work->threshold) break;
+    add_hit (work, p, w->win[best], best_p, k+1);
+    w->selected[best] = 1;
+    if (w->gss[best] <= 1e-8) break;
+
+    /* Rank-one update: orthogonalize the expression and the remaining
+       candidates against the new lead */
+    q = w->gres + (size_t)best*n;
+    norm = 1./sqrt(w->gss[best]);
+    for (i=0; i<n; i++) q[i] *= norm;
+    c = dot(q, w->y_res, n);
+    for (i=0; i<n; i++) {
+      w->y_res[i] -= c*q[i];
+      w->y_res_f[i] = (float)w->y_res[i];
+    }
+    if (work->test_type == 0) nonparam_order (w->y_res_f, n, w->order);
+    for (j=0; j<num_win; j++) {
+      if (w->selected[j]) continue;
+      g = w->gres + (size_t)j*n;
+      c = dot(q, g, n);
+      for (i=0; i<n; i++) g[i] -= c*q[i];
+      w->gss[j] = dot(g, g, n);
+    }
+  }
+}
+
+/* A Fail() (scratch over --mem-limit) is kept in work->error and stops
+   the other workers taking probes */
+static void *cond_worker (void *arg) {
+  cond_worker_t *w = (cond_worker_t *)arg;
+  cond_work_t *work = w->work;
+  error_trap_t trap;
+  int p;
+
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    pthread_mutex_lock (&work->lock);
+    if (work->error[0] == '\0') snprintf (work->error, sizeof(work->error), "%s", error_message());
+    work->next_phen = work->num_phens;
+    pthread_mutex_unlock (&work->lock);
+    return(NULL);
+  }
+  while (1) {
+    pthread_mutex_lock (&work->lock);
+    p = work->next_phen++;
+    pthread_mutex_unlock (&work->lock);
+    if (p >= work->num_phens) break;
+    cond_probe (w, p);
+  }
+  error_pop (&trap);
+  return(NULL);
+}
+
+/*
+ * Runs the stepwise scan over every probe's cis window, using the SNPs
+ * in genotypes that survived QC.  Returns the hits in probe order and
+ * step order within a probe.
+ */
+cond_hit_t *cond_cis_scan (snp_t *genotypes, phen_t *phenotypes, int test_type, int maxdist, double threshold, int num_threads, long long *num_hits_r) {
+  cond_work_t work;
+  cond_worker_t *workers;
+  pthread_t *threads;
+  cond_hit_t *hits;
+  snp_t *cur_snp;
+  phen_t *cur_phen;
+  long long num_hits;
+  int n = genotypes->num_indivs;
+  int i, p, k;
+
+  work.index = MallocOrDie(sizeof(snp_t *)*(genotypes->num_snps+1));
+  work.num_snps = 0;
+  for (cur_snp = genotypes; cur_snp != NULL; cur_snp = cur_snp->next) {
+    if (cur_snp->gt != NULL) work.index[work.num_snps++] = cur_snp;
+  }
+  qsort (work.index, work.num_snps, sizeof(snp_t *), &snp_pos_sort_func);
+
+  work.num_phens = 0;
+  for (cur_phen = phenotypes; cur_phen != NULL; cur_phen = cur_phen->next) work.num_phens++;
+  work.phens = MallocOrDie(sizeof(phen_t *)*(work.num_phens+1));
+  for (cur_phen = phenotypes, p=0; cur_phen != NULL; cur_phen = cur_phen->next, p++) {
+    work.phens[p] = cur_phen;
+  }
+  work.num_indivs = n;
+  work.test_type = test_type;
+  work.maxdist = maxdist;
+  work.threshold = threshold;
+  work.hits = MallocOrDie(sizeof(cond_hit_t *)*(work.num_phens+1));
+  work.num_hits = MallocOrDie(sizeof(int)*(work.num_phens+1));
+  for (p=0; p<work.num_phens; p++) {
+    work.hits[p] = NULL;
+    work.num_hits[p] = 0;
+  }
+  work.next_phen = 0;
+  work.error[0] = '\0';
+  pthread_mutex_init (&work.lock, NULL);
+
+  if (num_threads > work.num_phens) num_threads = work.num_phens;
+  if (num_threads < 1) num_threads = 1;
+  workers = MallocOrDie(sizeof(cond_worker_t)*num_threads);
+  threads = MallocOrDie(sizeof(pthread_t)*num_threads);
+  for (i=0; i<num_threads; i++) {
+    workers[i].work = &work;
+    workers[i].win = NULL;
+    workers[i].gres = NULL;
+    workers[i].gss = NULL;
+    workers[i].selected = NULL;
+    workers[i].max_win = 0;
+    workers[i].y_res = MallocOrDie(sizeof(double)*n);
+    workers[i].y_res_f = MallocOrDie(sizeof(float)*n);
+    workers[i].order = MallocOrDie(sizeof(int)*n);
+    workers[i].tie_counts = MallocOrDie(sizeof(int)*n);
+    if (pthread_create (&threads[i], NULL, &cond_worker, &workers[i]) != 0) Die("Could not start conditional scan thread\n");
+  }
+  for (i=0; i<num_threads; i++) {
+    pthread_join (threads[i], NULL);
+    if (workers[i].win != NULL) {
+      free(workers[i].win);
+      mem_free(workers[i].gres);
+      free(workers[i].gss);
+      free(workers[i].selected);
+    }
+    free(workers[i].y_res);
+    free(workers[i].y_res_f);
+    free(workers[i].order);
+    free(workers[i].tie_counts);
+  }
+  free(threads);
+  free(workers);
+  pthread_mutex_destroy (&work.lock);
+
+  num_hits = 0;
+  for (p=0; p<work.num_phens; p++) num_hits += work.num_hits[p];
+  hits = MallocOrDie(sizeof(cond_hit_t)*(num_hits+1));
+  num_hits = 0;
+  for (p=0; p<work.num_phens; p++) {
+    for (k=0; k<work.num_hits[p]; k++) hits[num_hits++] = work.hits[p][k];
+    if (work.hits[p] != NULL) free(work.hits[p]);
+  }
+  free(work.hits);
+  free(work.num_hits);
+  free(work.phens);
+  free(work.index);
+  if (work.error[0] != '\0') {
+    free(hits);
+    Fail("%s", work.error);
+  }
+
+  *num_hits_r = num_hits;
+  return(hits);
+}
@@ -0,0 +1,22 @@
+/*
+ * cond.h
+ *
+ * Forward stepwise conditional cis-eQTL analysis: independent signals
+ * per probe.
+ */
+
+#ifndef _cond_h
+#define _cond_h
+
+#include "structs.h"
+
+typedef struct _cond_hit_t {
+  snp_t *snp;
+  phen_t *phen;
+  double p;
+  int step;             /* 1 = lead SNP, 2 = first conditional signal, ... */
+} cond_hit_t;
+
+cond_hit_t *cond_cis_scan (snp_t *genotypes, phen_t *phenotypes, int test_type, int maxdist, double threshold, int num_threads, long long *num_hits_r);
+
+#endif
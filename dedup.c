@@ -0,0 +1,86 @@
+/*
+ * dedup.c
+ *
+ * Grouping of SNPs with identical recoded genotype vectors so each
+ * distinct vector is tested only once per probe.  In dense panels, SNPs
+ * in perfect LD and duplicate probes of one variant share a gt vector and
+ * therefore every test statistic.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "structs.h"
+#include "dedup.h"
+#include "mem.h"
+
+/* FNV-1a over the gt vector and number of groups */
+static unsigned long long hash_gt (snp_t *snp) {
+  unsigned long long h = 14695981039346656037ULL;
+  int i;
+
+  for (i=0; i<snp->num_indivs; i++) {
+    h ^= (unsigned char)snp->gt[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= (unsigned char)snp->num_groups;
+  h *= 1099511628211ULL;
+  return(h);
+}
+
+/*
+ * Hashes every SNP's gt vector into an open addressing table.  The first
+ * SNP seen with a given vector becomes the representative (dup_rep points
+ * to itself); later ones get dup_rep set to it and are chained onto its
+ * dup_next list in array order.  Returns the number of distinct vectors.
+ */
+int dedup_genotypes (snp_t **snps, int num_snps) {
+  snp_t **table;
+  snp_t **tail;
+  unsigned long long *hashes;
+  unsigned long long h, mask, size;
+  snp_t *cur, *rep;
+  int i, num_unique = 0;
+
+  for (size = 1; size < 2*(unsigned long long)num_snps; size <<= 1);
+  mask = size - 1;
+  table = mem_alloc(MEM_SCRATCH, sizeof(snp_t *)*size);
+  tail = mem_alloc(MEM_SCRATCH, sizeof(snp_t *)*size);
+  hashes = mem_alloc(MEM_SCRATCH, sizeof(unsigned long long)*size);
+  memset (table, 0, sizeof(snp_t *)*size);
+
+  for (i=0; i<num_snps; i++) {
+    cur = snps[i];
+    cur->dup_next = NULL;
+    h = hash_gt(cur);
+    while (1) {
+      rep = table[h & mask];
+      if (rep == NULL) {
+	table[h & mask] = cur;
+	tail[h & mask] = cur;
+	hashes[h & mask] = h;
+	cur->dup_rep = cur;
+	num_unique++;
+	break;
+      }
+      if (hashes[h & mask] == h && rep->num_groups == cur->num_groups &&
+	  memcmp(rep->gt, cur->gt, cur->num_indivs) == 0) {
+	cur->dup_rep = rep;
+	tail[h & mask]->dup_next = cur;
+	tail[h & mask] = cur;
+	break;
+      }
+      h++;
+    }
+  }
+
+  mem_free(hashes);
+  mem_free(tail);
+  mem_free(table);
+
+  return(num_unique);
+}
@@ -0,0 +1,15 @@
+/*
+ * dedup.h
+ *
+ * Grouping of SNPs with identical recoded genotype vectors so each
+ * distinct vector is tested only once per probe.
+ */
+
+#ifndef _dedup_h
+#define _dedup_h
+
+#include "structs.h"
+
+int dedup_genotypes (snp_t **snps, int num_snps);
+
+#endif
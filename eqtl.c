@@ -11,238 +11,156 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "squid.h"
 #include "sqfuncs.h"
 
 #include "structs.h"
+#include "libeqtl.h"
 #include "eqtlio.h"
-#include "nonparam.h"
-#include "regress.h"
+#include "cond.h"
+#include "mem.h"
 
 static char banner[] = "eqtl -- performs genome wide eQTL analysis\n";
 
 static char usage[] = "\
-Usage: eqtl [-options] <PLINK prefix> <gene list> <expression directory>\n\
+Usage: eqtl [-options] <PLINK prefix> <gene list> <expression directory> [<gene list> <expression directory> ...]\n\
   Available optiosn are:\n\
   -h      : help; print brief help on version and udage\n\
   -c      : Look for cis-eQTLs only\n\
 ";
 
 static char experts[] = "\
-   --test <s>     : Specifies test to do.  Options are kw [krusal-wallis] or reg [linear regression]\n\
+   --test <s>     : Specifies test to do.  Options are kw [krusal-wallis], reg [linear regression]\n\
+                    or inter [genotype x covariate interaction, needs --interaction]\n\
+   --interaction <f>: Covariate for --test inter, one \"<FID> <IID> <value>\" line per individual\n\
    --qnorm        : Quantile normalize the expression data\n\
    --dist <kb>    : Kilobases to do cis search in\n\
+   --fdr-hist     : Find FDR thresholds from a p-value histogram, no full sort\n\
+   --cpu <n>      : Number of threads to use [default: all processors]\n\
+   --maf <f>      : Drop SNPs with minor allele frequency below <f>\n\
+   --geno <f>     : Drop SNPs with more than fraction <f> of calls missing\n\
+   --hwe <p>      : Drop SNPs with Hardy-Weinberg exact test p below <p>\n\
+   --dedup        : Test SNPs with identical genotypes once per probe\n\
+   --stream       : Read genotypes a block at a time from <PLINK prefix>.bed/.bim/.fam\n\
+   --block <n>    : SNPs per block with --stream [default: 10000]\n\
+   --prescreen    : Skip trans tests that a cheap bound shows cannot reach significance\n\
+   --by-gene      : With -c, scan each gene's probes together (gene in the gene list's fifth column) and report genes\n\
+   --cond         : Also find independent cis signals per probe by stepwise conditioning\n\
+   --manifest <f> : Read <gene list> <expression directory> [<output file>] datasets from <f>\n\
+   --out <s>      : Write dataset k's results to <s>.k.txt [default with several datasets: eqtl]\n\
+   --keep <f>     : Analyze only the individuals listed in <f>, one \"<FID> <IID>\" per line\n\
+   --cache        : Keep recoded genotypes in <PLINK prefix>.gtc and reuse them while the .ped/.map keep their size and mtime\n\
+   --mem-limit <s>: Plan the run to fit in <s> bytes (e.g. 512M, 16G), streaming or spilling as needed, or refuse\n\
 ";
 
 static struct opt_s OPTIONS[] = {
   { "-h", TRUE, sqdARG_NONE },
   { "-c", TRUE, sqdARG_NONE },
   { "--test", FALSE, sqdARG_STRING },
+  { "--interaction", FALSE, sqdARG_STRING },
   { "--qnorm", FALSE, sqdARG_NONE },
-  { "--dist", FALSE, sqdARG_INT }
+  { "--dist", FALSE, sqdARG_INT },
+  { "--fdr-hist", FALSE, sqdARG_NONE },
+  { "--cpu", FALSE, sqdARG_INT },
+  { "--maf", FALSE, sqdARG_FLOAT },
+  { "--geno", FALSE, sqdARG_FLOAT },
+  { "--hwe", FALSE, sqdARG_FLOAT },
+  { "--dedup", FALSE, sqdARG_NONE },
+  { "--stream", FALSE, sqdARG_NONE },
+  { "--block", FALSE, sqdARG_INT },
+  { "--prescreen", FALSE, sqdARG_NONE },
+  { "--by-gene", FALSE, sqdARG_NONE },
+  { "--cond", FALSE, sqdARG_NONE },
+  { "--manifest", FALSE, sqdARG_STRING },
+  { "--out", FALSE, sqdARG_STRING },
+  { "--keep", FALSE, sqdARG_STRING },
+  { "--cache", FALSE, sqdARG_NONE },
+  { "--mem-limit", FALSE, sqdARG_STRING }
 };
 #define NOPTIONS (sizeof(OPTIONS)/sizeof(struct opt_s))
 
-int check_cis (snp_t *snp, phen_t *phen, int maxdist) {
-  int retval = 0;
-  
-  if (snp->chr == phen->chr &&
-      (((snp->pos < phen->start) && (phen->start - snp->pos <= maxdist)) ||
-       ((snp->pos > phen->stop) && (snp->pos - phen->stop <= maxdist)) ||
-       ((snp->pos >= phen->start) && (snp->pos <= phen->stop)))) {
-    retval = 1;
-  }
-  return(retval);
-}
-
-int result_sort_func (const void *a, const void *b) {    
-  result_t **i;
-  result_t **j;
-
-  i = (result_t **)a;
-  j = (result_t **)b;
-
-  if ((*i)->p < (*j)->p) {
-    return(-1);
-  } else if ((*i)->p > (*j)->p) {
-    return(1);
-  } else {
-    return (0);
-  }
-}
-
-result_t **get_results (snp_t *genotypes, phen_t *phenotypes, long long *tot_results_r, long long *total_tests_r, long long *total_cis_tests_r, int test_type, int cis_only, int maxdist) { 
-  long long estimated_results;
-  int phen_count = 0;
-  int iteration = 0;
-
-  phen_t *cur_phen;
-  snp_t *cur_snp;
-
-  float p = -1.0;
-  int flag;
-  int is_cis;
-  result_t **results;
-
-  long long tot_results = 0;
-  long long total_tests = 0;
-  long long total_cis_tests = 0;
-
-  int num_indivs;
-
-  int *sort_index = NULL;
-  float * rank = NULL;
-  int *tie_counts = NULL;
-
-  /* Prepare for analysis */
-  num_indivs = genotypes->num_indivs;
-
-  if (test_type == 0) {
-    sort_index = MallocOrDie(sizeof(int)*num_indivs);
-    tie_counts = MallocOrDie(sizeof(int)*num_indivs);
-    rank = MallocOrDie(sizeof(float)*num_indivs);
-  }
-
-  /* Count phenotypes and let us know how many tests */
-  for (cur_phen=phenotypes; cur_phen != NULL; cur_phen = cur_phen->next) {
-    phen_count++;
-  }
-  printf ("There are %d snps in %d phenotypes tested in %d individuals\n", genotypes->num_snps, phen_count, num_indivs);
-
-  /* Get estimated results memory */
-  estimated_results = 4*((long long)(MAXP * genotypes->num_snps * phen_count));
-  results = malloc(sizeof(result_t *)*estimated_results);
-  if (results == NULL) {
-    fprintf (stderr, "Tried to allocate %ld * %lld bytes for results_t and failed\n", sizeof(result_t), estimated_results);
-    exit(222);
-  }
-
-  for (cur_phen=phenotypes; cur_phen != NULL; cur_phen = cur_phen->next) {
-    fprintf (stderr, "Doing phenotype %s (iter %d)\n", cur_phen->name, iteration++);
-    for (cur_snp = genotypes; cur_snp != NULL; cur_snp = cur_snp->next) {
-      is_cis = check_cis(cur_snp, cur_phen, maxdist);
-      if (is_cis == 0 && cis_only == 1) continue;
-      switch (test_type) {
-      case 0:
-	p = nonparam_compar(cur_phen->values, cur_snp->gt, num_indivs, cur_snp->num_groups, sort_index, rank, tie_counts, &flag);
-	break;
-      case 1 :
-	p = regression_significance (cur_snp->gt, cur_phen->values, num_indivs);
-	flag = 0;
-	break;
-      default :
-	Die("No such test type %d\n", test_type);
-      }
-      total_tests++;
-
-      if (is_cis == 1) {
-	total_cis_tests++;
-      }
-      if (p > 1.001) {
-	fprintf (stderr, "P>1\trs%d\t%s\t%g\n", cur_snp->rs, cur_phen->name, p);
-      }
-      if (p <= MAXP) {
-	if (tot_results < estimated_results) {
-	  results[(tot_results)] = MallocOrDie(sizeof(result_t));
-	  results[(tot_results)]->snp = cur_snp;
-	  results[(tot_results)]->phen = cur_phen;
-	  results[tot_results]->p = p;
-	  results[tot_results]->flag = flag;
-	  results[tot_results]->good_for_cis = is_cis;
-	  tot_results++;
-	} else {
-	  Die("Estimated results off\n");
-	}
-      }
-    }
-  }
-
-  *total_cis_tests_r = total_cis_tests;
-  *tot_results_r = tot_results;
-  *total_tests_r = total_tests;
-
-  /* Now, sort the results in anticipation of B-H FDR */
-  qsort (results, tot_results, sizeof(result_t *), &result_sort_func);
-
-  if (test_type == 0) {
-    free(sort_index);
-    free(tie_counts);
-    free(rank);
+/* Prints one significant pair; arg is the output file.  After the
+   significance bits come the pair's stats: beta and SE for regression
+   and interaction; for K-W/M-W, per genotype group n, mean rank and
+   median, groups separated by '/' */
+static int print_hit (eqtl_hit_t *hit, void *arg) {
+  FILE *out = (FILE *)arg;
+  pair_stats_t *s = &hit->stats;
+
+  fprintf (out, "rs%d\t%d:%d\t%s\t%d:%d-%d\t%g\t%d\t%d", hit->snp->rs, hit->snp->chr, hit->snp->pos,
+	   hit->phen->name, hit->phen->chr, hit->phen->start, hit->phen->stop,
+	   hit->p, hit->flag, hit->sig);
+  switch (hit->test_type) {
+  case 0:
+    fprintf (out, "\t%d/%d/%d\t%g/%g/%g\t%g/%g/%g\n", s->n[0], s->n[1], s->n[2],
+	     s->mean_rank[0], s->mean_rank[1], s->mean_rank[2],
+	     s->median[0], s->median[1], s->median[2]);
+    break;
+  default:
+    fprintf (out, "\t%g\t%g\n", s->beta, s->se);
   }
-
-  return(results);
+  return(0);
 }
 
-void print_results (result_t **results, long long tot_results, double total_tests_d, double total_cis_tests_d, int cis_only) {
-
-  long long fdr_threshold_index = -1;
-  long long cis_fdr_threshold_index = -1;
-  long long k_for_cis_fdr = 0;
-
+/* One line per significant gene: its best pair, that pair's p, and the
+   gene's p corrected for the number of SNP-probe tests it made */
+void print_genes (FILE *out, eqtl_gene_hit_t *hits, int num_hits) {
+  eqtl_gene_hit_t *hit;
   int i;
-  int result_sig;
 
-  /* Now, do B-H to find FDR threshold, both cis and trans */
-  for (i=0; i < tot_results; i++) {
-    if (results[i]->p <= ((double)(i+1.))/total_tests_d * FDR_ALPHA) {
-      fdr_threshold_index = i;
-    }
-    if (results[i]->good_for_cis == 1) {
-      k_for_cis_fdr++;
-      if (results[i]->p <= ((double)(k_for_cis_fdr))/total_cis_tests_d * FDR_ALPHA) {
-	cis_fdr_threshold_index = i;
-      }
-    }
+  fprintf (out, "\nGene-level cis-eQTLs\n");
+  for (i=0; i<num_hits; i++) {
+    hit = &hits[i];
+    if (hit->sig == 0) continue;
+    fprintf (out, "%s\t%d\t%lld\trs%d\t%d:%d\t%s\t%g\t%g\t%d\n", hit->gene, hit->num_probes,
+	     hit->num_tests, hit->snp->rs, hit->snp->chr, hit->snp->pos, hit->phen->name,
+	     hit->min_p, hit->p, hit->sig);
   }
+}
 
-  /* Now, print results using bitwise marking of why sig:
-     1 = Trans Bonferonni
-     2 = Trans FDR
-     4 = P<1e-05
-     8 = Cis Bonferonni
-     16 = Cis FDR */
-  for (i = 0; i < tot_results; i++) {
-    result_sig = 0;
-    if (cis_only == 0) {
-      if (results[i]->p < ALPHA/ total_tests_d) result_sig++;
-      if (i <= fdr_threshold_index) result_sig += 2;
-      if (results[i]->p < THRESHOLD) result_sig += 4;
-    }
-    if (results[i]->good_for_cis == 1) {
-      if (results[i]->p < ALPHA/total_cis_tests_d) result_sig += 8;
-      if (i <= cis_fdr_threshold_index) result_sig += 16;
-    }
-    if (result_sig > 0) {
-      printf ("rs%d\t%d:%d\t%s\t%d:%d-%d\t%g\t%d\t%d\n", results[i]->snp->rs, results[i]->snp->chr, results[i]->snp->pos,
-	      results[i]->phen->name, results[i]->phen->chr, results[i]->phen->start, results[i]->phen->stop,
-	      results[i]->p, results[i]->flag, result_sig);
-    }
+/* One line per independent cis signal; the last column is the step at
+   which the SNP entered (1 = lead SNP) */
+void print_conditional (FILE *out, cond_hit_t *hits, long long num_hits) {
+  long long i;
+  cond_hit_t *hit;
+
+  fprintf (out, "\nConditional cis-eQTLs\n");
+  for (i=0; i<num_hits; i++) {
+    hit = &hits[i];
+    fprintf (out, "rs%d\t%d:%d\t%s\t%d:%d-%d\t%g\t%d\n", hit->snp->rs, hit->snp->chr, hit->snp->pos,
+	     hit->phen->name, hit->phen->chr, hit->phen->start, hit->phen->stop,
+	     hit->p, hit->step);
   }
 }
 
 int main (int argc, char **argv) {
-  snp_t *genotypes;
-  phen_t *phenotypes;
-
-  long long total_tests;
-  long long total_cis_tests;
-
-  result_t **results;
-  long long tot_results;
+  eqtl_opts_t opts;
+  eqtl_panel_t *panel;
+  eqtl_data_t *data;
+  eqtl_summary_t summary;
 
   char *optname;                /* name of option found by Getopt()        */
   char *optarg;                 /* argument found by Getopt()              */
   int   optind;                 /* index in argv[]                         */
   
-  int test_type = 0;            /* 0 = K-W, 1 = linear regression */
-  int quant_norm = 0;           /* Do quantile normalization */
-  int maxdist = 200000;         /* Max dist for cis search */
-  int cis_only = 0;
+  int conditional = 0;          /* Stepwise conditional cis scan */
+  cond_hit_t *cond_hits;
+  long long num_cond_hits;
+  char *manifest = NULL;        /* File listing the datasets */
+  char *out_prefix = NULL;      /* Per-dataset output file prefix */
+  long long mem_limit = 0;      /* Bytes the run must fit in, 0 for none */
+  mem_shape_t shape;
+  mem_plan_t plan;
+  int fits;
+  dataset_t *datasets;
+  int num_datasets;
+  FILE *out;
+  char *out_name;
+  int d;
 
   char *plink_prefix;
-  char *gene_list;
-  char *exp_dir;
 
   /**********************************************
    * Print header here 
@@ -253,50 +171,177 @@ int main (int argc, char **argv) {
   /*********************************************** 
    * Parse command line
    ***********************************************/
+  eqtl_default_opts (&opts);
+  opts.num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (opts.num_threads < 1) opts.num_threads = 1;
   while (Getopt(argc, argv, OPTIONS, NOPTIONS, usage,
                 &optind, &optname, &optarg))  {
     if (strcmp (optname, "--test") == 0) {
       if (strcmp(optarg, "kw") == 0) {
-	test_type = 0;
+	opts.test_type = 0;
       } else if (strcmp(optarg, "reg") == 0) {
-	test_type = 1;
+	opts.test_type = 1;
+      } else if (strcmp(optarg, "inter") == 0) {
+	opts.test_type = 2;
       } else {
 	Die("Unrecognized test %s\n", optarg);
       }
+    } else if (strcmp (optname, "--interaction") == 0) {
+      opts.interaction = optarg;
     } else if (strcmp(optname, "--qnorm") == 0) {
-      quant_norm = 1;
+      opts.quant_norm = 1;
     } else if (strcmp(optname, "-c") == 0) {
-      cis_only = 1;
+      opts.cis_only = 1;
     } else if (strcmp (optname, "--dist") == 0) {
-      maxdist = 1000 * atoi(optarg);
+      opts.maxdist = 1000 * atoi(optarg);
+    } else if (strcmp (optname, "--fdr-hist") == 0) {
+      opts.use_hist = 1;
+    } else if (strcmp (optname, "--cpu") == 0) {
+      opts.num_threads = atoi(optarg);
+      if (opts.num_threads < 1) Die("--cpu must be at least 1\n");
+    } else if (strcmp (optname, "--maf") == 0) {
+      opts.qc.min_maf = atof(optarg);
+      opts.do_qc = 1;
+    } else if (strcmp (optname, "--geno") == 0) {
+      opts.qc.max_missing = atof(optarg);
+      opts.do_qc = 1;
+    } else if (strcmp (optname, "--hwe") == 0) {
+      opts.qc.min_hwe_p = atof(optarg);
+      opts.do_qc = 1;
+    } else if (strcmp (optname, "--dedup") == 0) {
+      opts.dedup = 1;
+    } else if (strcmp (optname, "--stream") == 0) {
+      opts.streaming = 1;
+    } else if (strcmp (optname, "--block") == 0) {
+      opts.block_size = atoi(optarg);
+      if (opts.block_size < 1) Die("--block must be at least 1\n");
+    } else if (strcmp (optname, "--prescreen") == 0) {
+      opts.prescreen = 1;
+    } else if (strcmp (optname, "--by-gene") == 0) {
+      opts.by_gene = 1;
+    } else if (strcmp (optname, "--cond") == 0) {
+      conditional = 1;
+    } else if (strcmp (optname, "--manifest") == 0) {
+      manifest = optarg;
+    } else if (strcmp (optname, "--out") == 0) {
+      out_prefix = optarg;
+    } else if (strcmp (optname, "--keep") == 0) {
+      opts.keep_file = optarg;
+    } else if (strcmp (optname, "--cache") == 0) {
+      opts.use_cache = 1;
+    } else if (strcmp (optname, "--mem-limit") == 0) {
+      mem_limit = mem_parse_size(optarg);
     } else if (strcmp (optname, "-h") == 0) {
       puts(usage);
       puts(experts);
       exit(EXIT_SUCCESS);
     } 
   }
-  if (argc - optind != 3) {
+  if (manifest != NULL ? argc - optind != 1 : (argc - optind < 3 || (argc - optind) % 2 != 1)) {
     Die("Incorrect number of arguments\n%s\n", usage);
   }
 
   plink_prefix=argv[optind++];
-  gene_list =argv[optind++];
-  exp_dir = argv[optind++];
+  if (manifest != NULL) {
+    datasets = read_manifest (manifest, &num_datasets);
+  } else {
+    num_datasets = (argc - optind)/2;
+    datasets = MallocOrDie(sizeof(dataset_t)*num_datasets);
+    for (d=0; d<num_datasets; d++) {
+      datasets[d].gene_list = argv[optind++];
+      datasets[d].exp_dir = argv[optind++];
+      datasets[d].out_file = NULL;
+    }
+  }
+  if (num_datasets > 1 && out_prefix == NULL) out_prefix = "eqtl";
+
+  if (opts.by_gene && !opts.cis_only) Die("--by-gene needs -c\n");
+  if ((opts.test_type == 2) != (opts.interaction != NULL)) Die("--test inter and --interaction go together\n");
+  if (opts.test_type == 2 && (conditional || opts.prescreen)) Die("--cond and --prescreen do not support --test inter\n");
+  if (conditional && opts.streaming) Die("--cond needs genotypes in memory; it cannot be used with --stream\n");
+  if (num_datasets > 1 && opts.streaming) Die("Several datasets need genotypes in memory; they cannot be used with --stream\n");
 
   if (sizeof(long long) < 8) Die("Long is only %d; fix tot_tests\n", sizeof(long));
 
-  genotypes = read_genotypes(plink_prefix);
+  /* Size the run from the input files before loading anything, and give
+     up memory-hungry options until it fits */
+  if (mem_limit > 0) {
+    mem_shape_from_files (&shape, plink_prefix, datasets, num_datasets);
+    shape.test_type = opts.test_type;
+    shape.cis_only = opts.cis_only;
+    shape.dedup = opts.dedup;
+    shape.prescreen = opts.prescreen;
+    shape.conditional = conditional;
+    plan.limit = mem_limit;
+    plan.streaming = opts.streaming;
+    plan.block_size = opts.block_size;
+    plan.use_hist = opts.use_hist;
+    plan.spill = 0;
+    plan.num_threads = opts.num_threads;
+    fits = mem_plan (&plan, &shape);
+    mem_print_plan (stderr, &plan, &shape);
+    if (!fits) Die("This run does not fit in --mem-limit even with the least memory plan above\n");
+    opts.streaming = plan.streaming;
+    opts.block_size = plan.block_size;
+    opts.use_hist = plan.use_hist;
+    opts.num_threads = plan.num_threads;
+    mem_enforce (&plan);
+  }
+
+  /* Genotypes are loaded, recoded and QCed once and shared by every
+     dataset */
+  opts.log = stdout;
+  if (eqtl_load_panel (plink_prefix, &opts, &panel) != EQTL_OK) Die("%s", eqtl_error());
+
+  for (d=0; d<num_datasets; d++) {
+    out = stdout;
+    out_name = NULL;
+    if (datasets[d].out_file != NULL || out_prefix != NULL) {
+      if (datasets[d].out_file != NULL) {
+	out_name = sre_strdup(datasets[d].out_file, -1);
+      } else {
+	out_name = MallocOrDie(sizeof(char)*(strlen(out_prefix)+32));
+	sprintf (out_name, "%s.%d.txt", out_prefix, d+1);
+      }
+      out = fopen(out_name, "w");
+      if (out == NULL) Die("Cannot write %s\n", out_name);
+      fprintf (stderr, "Dataset %d: %s %s -> %s\n", d+1, datasets[d].gene_list, datasets[d].exp_dir, out_name);
+    }
+    opts.log = out;
 
-  phenotypes = read_phenotypes (gene_list, exp_dir, genotypes->num_indivs, genotypes->id_list, quant_norm);
+    if (eqtl_load_data (panel, datasets[d].gene_list, datasets[d].exp_dir, &opts, &data) != EQTL_OK ||
+	eqtl_scan (panel, data, &opts, &print_hit, out, &summary) != EQTL_OK) {
+      Die("%s", eqtl_error());
+    }
+    if (summary.genes != NULL) {
+      print_genes (out, summary.genes, summary.num_genes);
+      free(summary.genes);
+    }
 
-  results = get_results (genotypes, phenotypes, &tot_results, &total_tests, &total_cis_tests, test_type, cis_only, maxdist);
+    if (conditional) {
+      if (eqtl_conditional (panel, data, &opts, ALPHA/(double)summary.total_cis_tests, &cond_hits, &num_cond_hits) != EQTL_OK) {
+	Die("%s", eqtl_error());
+      }
+      print_conditional (out, cond_hits, num_cond_hits);
+      free(cond_hits);
+    }
 
-  printf ("There are %lld total tests and %lld total cis tests\n", total_tests, total_cis_tests);
+    if (out != stdout) {
+      fprintf (out, "\nFin\n");
+      fclose(out);
+      free(out_name);
+    }
+    eqtl_free_data (data);
+  }
+  eqtl_free_panel (panel);
+  if (mem_limit > 0) mem_report (stderr);
+  if (manifest != NULL) {
+    free_manifest (datasets, num_datasets);
+  } else {
+    free(datasets);
+  }
 
-  print_results (results, tot_results, (double)total_tests, (double)total_cis_tests, cis_only);
-  
   printf ("\nFin\n");
 
   return(0);
 }
-  
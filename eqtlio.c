@@ -11,7 +11,12 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <math.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <gsl/gsl_cdf.h>
 
 #include "squid.h"
@@ -19,223 +24,482 @@
 
 #include "structs.h"
 #include "eqtlio.h"
+#include "mem.h"
+#include "arena.h"
+#include "error.h"
 
-char get_gt_code (char *c) {
-  char *d;
-  if (*c == '0') {
-    return(0);
-  } else {
-    d = c;
-    while (!isspace(*d)) d++;
-    while (isspace(*d)) d++;
-    if (*c == 'A')
-      if (*d == 'A') return(1);
-      else if (*d == 'C') return(2);
-      else if (*d == 'G') return(3);
-      else if (*d == 'T') return(4);
-      else return (0);
-    else if (*c == 'C') 
-      if (*d == 'A') return(2);
-      else if (*d == 'C') return(5);
-      else if (*d == 'G') return(6);
-      else if (*d == 'T') return(7);
-      else return(0);
-    else if (*c == 'G') 
-      if (*d == 'A') return (3);
-      else if (*d == 'C') return(6);
-      else if (*d == 'G') return(8);
-      else if (*d == 'T') return(9);
-      else return(0);
-    else if (*c == 'T')
-      if (*d == 'A') return(4);
-      else if (*d == 'C') return(7);
-      else if (*d == 'G') return(9);
-      else if (*d == 'T') return(10);
-      else return(0);
-    else return(0);
-  }
-}
+/*
+ * Genotype coding.  While loading, each call is stored as an unordered
+ * pair of allele ids packed into a byte, 16*lo + hi, with 0 for missing.
+ * Allele ids are:
+ *   1-4   A, C, G, T (also PLINK's 1-4 coding)
+ *   5, 6  the SNP's listed alleles (.bim, or columns 5-6 of a .map) when
+ *         they are not single bases, e.g. indels
+ *   7, 8  I and D
+ *   15    anything else, which makes the site unsupported
+ * recode_gt then works out the two alleles at the site from a histogram
+ * of the pair codes and recodes every call through a 256-entry table.
+ */
+#define ALLELE_UNKNOWN 15
 
-void finish_recode (char *gt, int n, int g1, int g2, int g3) {
-  int i, g;
+static char *base_names[9] = { "", "A", "C", "G", "T", NULL, NULL, "I", "D" };
 
-  for (i=0; i<n; i++) {
-    g = (int)(gt[i]);
-    if (g == 0) {
-      gt[i] = (char)127;
-    } else if (g == g1) {
-      gt[i] = (char)0;
-    } else if (g == g2) {
-      gt[i] = (char)1;
-    } else if (g == g3) {
-      gt[i] = (char)2;
-    } else {
-      Die("Bad char %c for %d,%d,%d\n", gt[i], g1,g2,g3);
+static int allele_id (snp_t *snp, char *tok, int len) {
+  int a;
+
+  if (len == 1) {
+    switch (tok[0]) {
+    case '0': case 'N': return(0);
+    case 'A': case '1': return(1);
+    case 'C': case '2': return(2);
+    case 'G': case '3': return(3);
+    case 'T': case '4': return(4);
+    }
+  }
+  for (a=0; a<2; a++) {
+    if (snp->alleles[a] != NULL && strncmp(snp->alleles[a], tok, len) == 0 &&
+	snp->alleles[a][len] == '\0') {
+      return(5+a);
     }
   }
+  if (len == 1 && tok[0] == 'I') return(7);
+  if (len == 1 && tok[0] == 'D') return(8);
+  return(ALLELE_UNKNOWN);
+}
+
+static char *allele_name (snp_t *snp, int id) {
+  if (id == 5 || id == 6) return(snp->alleles[id-5]);
+  return(base_names[id]);
 }
 
+static unsigned char pair_code (int a, int b) {
+  if (a == 0 || b == 0) return(0);
+  return((unsigned char)(a < b ? 16*a + b : 16*b + a));
+}
+
+/* Pair code for the two whitespace separated alleles starting at c */
+static unsigned char get_gt_code (snp_t *snp, char *c) {
+  char *d, *ce, *de;
+
+  for (ce=c; !isspace(*ce); ce++);
+  for (d=ce; isspace(*d); d++);
+  for (de=d; !isspace(*de); de++);
+  return(pair_code(allele_id(snp, c, ce-c), allele_id(snp, d, de-d)));
+}
 
-/* Goal here is to take initial GT codings and recode for use in both K-W
-   and regression.  Missing is coded as 127.
+/* Goal here is to take the pair codes and recode for use in both K-W and
+   regression.  Missing is coded as 127.
    Algorithm:
-   1.  Count how many of each GT group.  
-   2.  Create a bitmask to mark which groups are > 0
-   3.  Manually code all valid 3- and 2-group mixtures.  Rest give errors
+   1.  Histogram the pair codes.
+   2.  Find the alleles present; the site needs exactly two, which are
+       ordered by name (so A/C/G/T sites code as they always have).
+   3.  Number the genotype classes present (hom, het, other hom) from 0
+       and recode through a lookup table.
+   Returns the number of groups, or 0 with *why set if the site cannot be
+   tested.  geno_counts gets the number of homozygotes, heterozygotes,
+   other homozygotes and missing calls for QC.
 */
-int recode_gt (char *gt, int n) {
-  int i;
-  int counts[11];
-  int cur_gt;
-  int bitmask;
+int recode_gt (snp_t *snp, char *gt, int n, int *geno_counts, char **why) {
+  int counts[256];
+  unsigned char table[256];
+  unsigned char cls[3];
+  int ids[2];
+  int mask, num_alleles, num_groups;
+  int i, c, t;
 
-  for (i=0; i<12; i++) counts[i] = 0;
+  memset (counts, 0, sizeof(counts));
   for (i=0; i<n; i++) {
-    cur_gt = (int)gt[i];
-    if (cur_gt < 0 || cur_gt > 10) {
-      Die("gt out of range (%d)\n", cur_gt);
-    }
-    counts[cur_gt]++;
-  }
-
-  /* Now, create bitmask */
-  bitmask = 0;
-  for (i=1; i<11; i++) {
-    if (counts[i] > 0) {
-      bitmask += (1 << (i-1));
-    }
-  }
-
-  /* Now, manually test bitmask */
-  switch (bitmask) {
-    /* First, 3-group case */
-  case (19):  /* A/C */
-    finish_recode(gt, n, 1, 2, 5);
-    return(3);
-  case (133): /* A/G */
-    finish_recode(gt, n, 1, 3, 8);
-    return(3);
-  case (521): /* A/T */
-    finish_recode(gt, n, 1, 4, 10);
-    return(3);
-  case (176): /* C/G */
-    finish_recode(gt, n, 5, 6, 8);
-    return(3);
-  case (592): /* C/T */
-    finish_recode(gt, n, 5, 7, 10);
-    return(3);
-  case (896): /* G/T */
-    finish_recode(gt, n, 8, 9, 10);
-    return(3);
-    
-    /* Now, 2-group including first as het */
-  case (3):   /* A/C */
-    finish_recode (gt, n, 1, 2, 15);
-    return(2);
-  case (5): /* A/G */
-    finish_recode (gt, n, 1, 3, 15);
-    return(2);
-  case (9): /* A/T */
-    finish_recode (gt, n, 1, 4, 15);
-    return(2);
-  case (48): /* C/G */
-    finish_recode (gt, n, 5, 6, 15);
-    return(2);
-  case (80): /* C/T */
-    finish_recode (gt, n, 5, 7, 15);
-    return(2);
-  case (384): /* G/T */
-    finish_recode (gt, n, 8, 9, 15);
-    return(2);
-
-    /* Now, 2-group including last as het */
-  case (18):   /* A/C */
-    finish_recode (gt, n, 2, 5, 15);
-    return(2);
-  case (132): /* A/G */
-    finish_recode (gt, n, 3, 8, 15);
-    return(2);
-  case (520): /* A/T */
-    finish_recode (gt, n, 4, 10, 15);
-    return(2);
-  case (160): /* C/G */
-    finish_recode (gt, n, 6, 8, 15);
-    return(2);
-  case (576): /* C/T */
-    finish_recode (gt, n, 7, 10, 15);
-    return(2);
-  case (768): /* G/T */
-    finish_recode (gt, n, 9, 10, 15);
-    return(2);
-    
-    /* Now, 2-groups, no hets */
-  case (17):   /* A/C */
-    finish_recode (gt, n, 1, 5, 15);
-    return(2);
-  case (129): /* A/G */
-    finish_recode (gt, n, 1, 8, 15);
-    return(2);
-  case (513): /* A/T */
-    finish_recode (gt, n, 1, 10, 15);
-    return(2);
-  case (144): /* C/G */
-    finish_recode (gt, n, 5, 8, 15);
-    return(2);
-  case (528): /* C/T */
-    finish_recode (gt, n, 5, 10, 15);
-    return(2);
-  case (640): /* G/T */
-    finish_recode (gt, n, 8, 10, 15);
-    return(2);
-  }
-
-  for (i=0; i<11; i++){
-    printf ("%d\t%d\n", i, counts[i]);
-  }
-  Die("Bad bitmask %d\n", bitmask);
-  return(0);
+    counts[(unsigned char)gt[i]]++;
+  }
+
+  mask = 0;
+  for (c=1; c<256; c++) {
+    if (counts[c] > 0) mask |= (1 << (c >> 4)) | (1 << (c & 15));
+  }
+  if (mask & (1 << ALLELE_UNKNOWN)) {
+    *why = "unrecognized allele";
+    return(0);
+  }
+  num_alleles = 0;
+  for (i=1; i<ALLELE_UNKNOWN; i++) {
+    if (mask & (1 << i)) {
+      if (num_alleles < 2) ids[num_alleles] = i;
+      num_alleles++;
+    }
+  }
+  if (num_alleles < 2) {
+    *why = "monomorphic";
+    return(0);
+  } else if (num_alleles > 2) {
+    *why = "more than two alleles";
+    return(0);
+  }
+  if (strcmp(allele_name(snp, ids[0]), allele_name(snp, ids[1])) > 0) {
+    t = ids[0];
+    ids[0] = ids[1];
+    ids[1] = t;
+  }
+
+  cls[0] = pair_code(ids[0], ids[0]);
+  cls[1] = pair_code(ids[0], ids[1]);
+  cls[2] = pair_code(ids[1], ids[1]);
+  memset (table, 127, sizeof(table));
+  num_groups = 0;
+  for (i=0; i<3; i++) {
+    geno_counts[i] = counts[cls[i]];
+    if (counts[cls[i]] > 0) table[cls[i]] = (unsigned char)num_groups++;
+  }
+  geno_counts[3] = counts[0];
+  if (num_groups < 2) {
+    *why = "only one genotype";
+    return(0);
+  }
+
+  for (i=0; i<n; i++) {
+    gt[i] = (char)table[(unsigned char)gt[i]];
+  }
+  return(num_groups);
 }
 
-void check_recoded_gt (char *gt, int n, int g) {
-  int i;
-  int a;
-  if (g == 2) {
-    for (i=0; i<n; i++) {
-      a = (int)gt[i];
-      if (a != 0 && a != 1 && a != 15 && a != 127) {
-	Die("Bad check\n");
+/* 
+ * Pipelined .ped loader.  One reader thread pulls the file in large
+ * blocks and queues runs of complete lines; parser threads turn each line
+ * into one column of a preallocated SNP-major genotype matrix.  A parser
+ * fills a batch's columns in a private staging buffer, SNP-major, and
+ * then copies each SNP's run of individuals into the matrix, so threads
+ * working on neighbouring individuals share cache lines only at the ends
+ * of their runs rather than on every byte.  The
+ * number of individuals is bounded above from the file size (every
+ * genotype takes at least 4 chars, the six leading fields at least 12),
+ * so the matrix can be allocated before the file is read, once.
+ */
+#define PED_BLOCK_SIZE (16*1024*1024)
+
+typedef struct _ped_batch_t {
+  char *data;
+  size_t len;
+  int first_indiv;
+  int num_lines;            /* Not counting blank lines */
+  struct _ped_batch_t *next;
+} ped_batch_t;
+
+typedef struct _ped_loader_t {
+  FILE *f;
+  char *filename;
+  int num_snps;
+  snp_t **snp_index;        /* For each SNP's listed alleles */
+  char *gt_matrix;          /* num_snps rows of max_indivs */
+  int max_indivs;
+  char **ids;
+  int num_indivs;           /* Final count, set by reader */
+  arena_t *arena;           /* For the IDs */
+  char error[256];          /* First data error, raised after the join */
+
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  ped_batch_t *head, *tail;
+  int queued, max_queued;
+  int done;
+} ped_loader_t;
+
+typedef struct _recode_job_t {
+  snp_t **snp_index;
+  int first, last;
+  int num_indivs;
+  unsigned char *raw;       /* .bed records to decode first, or NULL */
+  int raw_first;
+  long long bytes_per_snp;
+} recode_job_t;
+
+/* Loader threads cannot Fail(); the first error is kept for the caller */
+static void ped_error (ped_loader_t *ld, char *format, ...) {
+  va_list ap;
+
+  pthread_mutex_lock (&ld->lock);
+  if (ld->error[0] == '\0') {
+    va_start (ap, format);
+    vsnprintf (ld->error, sizeof(ld->error), format, ap);
+    va_end (ap);
+  }
+  pthread_mutex_unlock (&ld->lock);
+}
+
+static void ped_enqueue (ped_loader_t *ld, char *data, size_t len, int first_indiv, int num_lines) {
+  ped_batch_t *batch;
+
+  batch = MallocOrDie(sizeof(ped_batch_t));
+  batch->data = data;
+  batch->len = len;
+  batch->first_indiv = first_indiv;
+  batch->num_lines = num_lines;
+  batch->next = NULL;
+
+  pthread_mutex_lock (&ld->lock);
+  while (ld->queued >= ld->max_queued) {
+    pthread_cond_wait (&ld->not_full, &ld->lock);
+  }
+  if (ld->tail == NULL) {
+    ld->head = batch;
+  } else {
+    ld->tail->next = batch;
+  }
+  ld->tail = batch;
+  ld->queued++;
+  pthread_cond_signal (&ld->not_empty);
+  pthread_mutex_unlock (&ld->lock);
+}
+
+/* Reader thread: block reads, handing off everything up to the last
+   newline and carrying the partial line into the next block */
+static void *ped_reader (void *arg) {
+  ped_loader_t *ld = (ped_loader_t *)arg;
+  char *buf, *next_buf, *cp, *last_nl;
+  size_t cap, len, nread;
+  int cur_indiv = 0;
+  int lines;
+
+  cap = PED_BLOCK_SIZE;
+  buf = MallocOrDie(cap + 1);
+  len = 0;
+  while (1) {
+    if (len == cap) {
+      /* A single line bigger than the block; grow */
+      cap *= 2;
+      buf = ReallocOrDie(buf, cap + 1);
+    }
+    nread = fread (buf + len, 1, cap - len, ld->f);
+    len += nread;
+    if (nread == 0 && len > 0 && buf[len-1] != '\n') {
+      buf[len++] = '\n';   /* cap has room for this */
+    }
+
+    last_nl = NULL;
+    lines = 0;
+    for (cp = memchr(buf, '\n', len); cp != NULL; cp = memchr(cp+1, '\n', len - (cp+1-buf))) {
+      if (cp > buf && *(cp-1) != '\n') lines++;    /* Skip blank lines */
+      last_nl = cp;
+    }
+    if (last_nl != NULL) {
+      next_buf = MallocOrDie(cap + 1);
+      len -= (last_nl + 1 - buf);
+      memcpy (next_buf, last_nl + 1, len);
+      if (cur_indiv + lines > ld->max_indivs) {
+	ped_error (ld, "More individuals in %s than its size allows\n", ld->filename);
+	free(next_buf);
+	break;
       }
+      ped_enqueue (ld, buf, last_nl + 1 - buf, cur_indiv, lines);
+      cur_indiv += lines;
+      buf = next_buf;
     }
-  } else if (g == 3) {
-    for (i=0; i<n; i++) {
-      a = (int)gt[i];
-      if (a != 0 && a != 1 && a != 2 && a != 127) {
-	Die("Bad check\n");
+    if (nread == 0) break;
+  }
+  free(buf);
+
+  pthread_mutex_lock (&ld->lock);
+  ld->num_indivs = cur_indiv;
+  ld->done = 1;
+  pthread_cond_broadcast (&ld->not_empty);
+  pthread_mutex_unlock (&ld->lock);
+  return(NULL);
+}
+
+/* Parses one .ped line (ending in newline) for individual indiv into
+   col, whose SNPs are stride bytes apart */
+static void parse_ped_line (ped_loader_t *ld, char *line, char *end, int indiv, char *col, int stride) {
+  char *cp;
+  int field, s;
+
+  cp = line;
+  while (!isspace(*cp)) cp++;
+  while (isspace(*cp) && cp < end) cp++;
+  while (!isspace(*cp)) cp++;
+  ld->ids[indiv] = arena_strndup(ld->arena, line, cp-line);
+
+  for (field=0; field<4; field++) {
+    while (isspace(*cp) && cp < end) cp++;
+    while (!isspace(*cp)) cp++;
+  }
+  while (isspace(*cp) && cp < end) cp++;
+
+  /* Now, we're at the gt's */
+  for (s=0; s<ld->num_snps; s++) {
+    if (cp >= end) {
+      ped_error (ld, "Only %d of %d genotypes for %s\n", s, ld->num_snps, ld->ids[indiv]);
+      return;
+    }
+    col[(long long)s*stride] = (char)get_gt_code(ld->snp_index[s], cp);
+    while (!isspace(*cp)) cp++;
+    while (isspace(*cp) && cp < end) cp++;
+    while (!isspace(*cp)) cp++;
+    while (isspace(*cp) && cp < end) cp++;
+  }
+}
+
+/* A Fail() while parsing (an ID over --mem-limit) is kept by ped_error,
+   and the thread goes on taking batches so the reader never blocks */
+static void *ped_parser (void *arg) {
+  ped_loader_t *ld = (ped_loader_t *)arg;
+  ped_batch_t *batch;
+  error_trap_t trap;
+  char *line, *eol, *end;
+  char *stage = NULL;
+  long long stage_size = 0;
+  int indiv, k, s, nl;
+
+  while (1) {
+    pthread_mutex_lock (&ld->lock);
+    while (ld->head == NULL && !ld->done) {
+      pthread_cond_wait (&ld->not_empty, &ld->lock);
+    }
+    batch = ld->head;
+    if (batch == NULL) {
+      pthread_mutex_unlock (&ld->lock);
+      break;
+    }
+    ld->head = batch->next;
+    if (ld->head == NULL) ld->tail = NULL;
+    ld->queued--;
+    pthread_cond_signal (&ld->not_full);
+    pthread_mutex_unlock (&ld->lock);
+
+    nl = batch->num_lines;
+    if ((long long)nl*ld->num_snps > stage_size) {
+      stage_size = (long long)nl*ld->num_snps;
+      if (stage != NULL) free(stage);
+      stage = MallocOrDie(stage_size);
+    }
+    error_push (&trap);
+    if (setjmp(trap.env) == 0) {
+      indiv = batch->first_indiv;
+      k = 0;
+      end = batch->data + batch->len;
+      for (line = batch->data; line < end && k < nl; line = eol + 1) {
+	eol = memchr(line, '\n', end - line);
+	if (eol == line) continue;      /* blank line */
+	parse_ped_line (ld, line, eol, indiv + k, stage + k, nl);
+	k++;
+      }
+      for (s=0; s<ld->num_snps; s++) {
+	memcpy (ld->gt_matrix + (long long)s*ld->max_indivs + indiv, stage + (long long)s*nl, nl);
       }
+      error_pop (&trap);
+    } else {
+      ped_error (ld, "%s", error_message());
+    }
+    free(batch->data);
+    free(batch);
+  }
+  if (stage != NULL) free(stage);
+  return(NULL);
+}
+
+/* Unpacks SNP-major PLINK .bed calls (2 bits per individual: 00 hom A1,
+   01 missing, 10 het, 11 hom A2) into allele pair codes via a per-SNP
+   4-entry table */
+static void decode_bed_snp (snp_t *snp, unsigned char *raw, int num_indivs) {
+  char codes[4];
+  int a1, a2;
+  int i;
+
+  a1 = allele_id(snp, snp->alleles[0], strlen(snp->alleles[0]));
+  a2 = allele_id(snp, snp->alleles[1], strlen(snp->alleles[1]));
+  codes[0] = (char)pair_code(a1, a1);
+  codes[1] = 0;
+  codes[2] = (char)pair_code(a1, a2);
+  codes[3] = (char)pair_code(a2, a2);
+  for (i=0; i<num_indivs; i++) {
+    snp->gt[i] = codes[(raw[i >> 2] >> ((i & 3) << 1)) & 3];
+  }
+}
+
+/* Sites recode_gt cannot code are logged and lose their gt */
+static void *recode_worker (void *arg) {
+  recode_job_t *job = (recode_job_t *)arg;
+  snp_t *snp;
+  char *why;
+  int s;
+
+  for (s=job->first; s<job->last; s++) {
+    snp = job->snp_index[s];
+    if (job->raw != NULL) {
+      decode_bed_snp (snp, job->raw + (long long)(s - job->raw_first)*job->bytes_per_snp, job->num_indivs);
     }
+    snp->num_groups = recode_gt (snp, snp->gt, job->num_indivs, snp->geno_counts, &why);
+    if (snp->num_groups == 0) {
+      fprintf (stderr, "Skipping rs%d (%d:%d): %s\n", snp->rs, snp->chr, snp->pos, why);
+      snp->gt = NULL;
+    }
+  }
+  return(NULL);
+}
+
+/* Drops SNPs that recode_gt skipped from snp_index[first..last), keeping
+   order; returns how many are left */
+static int drop_skipped (snp_t **snp_index, int first, int last) {
+  int s, kept;
+
+  kept = first;
+  for (s=first; s<last; s++) {
+    if (snp_index[s]->gt != NULL) snp_index[kept++] = snp_index[s];
   }
-  printf ("%d\n", n);
+  return(kept - first);
 }
 
-snp_t *read_genotypes (char *filename) {
+/* Recodes snp_index[first..last) in parallel, each thread taking a
+   contiguous run of SNPs.  If raw is given, the SNPs' gt arrays are first
+   filled from raw .bed records starting with SNP first. */
+static void recode_snps (snp_t **snp_index, int first, int last, int num_indivs, int num_threads,
+			 unsigned char *raw, long long bytes_per_snp) {
+  pthread_t *workers;
+  recode_job_t *jobs;
+  int i, n;
+
+  n = last - first;
+  workers = MallocOrDie(sizeof(pthread_t)*num_threads);
+  jobs = MallocOrDie(sizeof(recode_job_t)*num_threads);
+  for (i=0; i<num_threads; i++) {
+    jobs[i].snp_index = snp_index;
+    jobs[i].first = first + (int)((long long)n*i/num_threads);
+    jobs[i].last = first + (int)((long long)n*(i+1)/num_threads);
+    jobs[i].num_indivs = num_indivs;
+    jobs[i].raw = raw;
+    jobs[i].raw_first = first;
+    jobs[i].bytes_per_snp = bytes_per_snp;
+    if (pthread_create (&workers[i], NULL, &recode_worker, &jobs[i]) != 0) Die("Could not start recode thread\n");
+  }
+  for (i=0; i<num_threads; i++) {
+    pthread_join (workers[i], NULL);
+  }
+  free(jobs);
+  free(workers);
+}
+
+/* Reads a .map file, or a .bim file (same first four columns, then the
+   two alleles) if with_alleles is 1.  A .map may also list the two
+   alleles in columns five and six. */
+static snp_t *read_map (char *filename, int with_alleles, arena_t *arena, int *num_snps_r) {
   snp_t *start, *cur, *prev;
-  char **ids;
-  int cur_id;
   FILE *f;
-  char *buf;
-  char *cp;
-  int num_snps = 0, num_indivs = 0;
-
-  buf = MallocOrDie(256);
-  prev = NULL;
+  error_trap_t trap;
+  char buf[1024];
+  char *cp, *ep;
+  int a;
+  int num_snps = 0;
 
-  sprintf (buf, "%s.map", filename);
-  f = fopen(buf, "r");
-  if (f==NULL) Die("Cannot open %s\n", buf);
+  f = fopen(filename, "r");
+  if (f==NULL) Fail("Cannot open %s\n", filename);
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    fclose(f);
+    error_rethrow ();
+  }
   start = NULL;
+  prev = NULL;
 
-  while (fgets(buf, 255, f)) {
-    cur = (snp_t *)MallocOrDie(sizeof(snp_t));
+  while (fgets(buf, 1023, f)) {
+    cur = (snp_t *)arena_alloc(arena, sizeof(snp_t));
     if (start == NULL) {
       start = cur;
     } else {
@@ -246,6 +510,9 @@ snp_t *read_genotypes (char *filename) {
     cur->next = NULL;
     cur->id_list = NULL;
     cur->gt = NULL;
+    cur->dup_rep = NULL;
+    cur->dup_next = NULL;
+    cur->alleles[0] = cur->alleles[1] = NULL;
 
     if ((isdigit(buf[0]) && isspace(buf[1])) ||
 	(isdigit(buf[0]) && isdigit(buf[1]) && isspace(buf[2]))) {
@@ -273,79 +540,409 @@ snp_t *read_genotypes (char *filename) {
     while (isspace(*cp)) cp++;
     cur->pos = atoi(cp);
 
+    for (a=0; a<2; a++) {
+      while (*cp != '\0' && !isspace(*cp)) cp++;
+      while (isspace(*cp)) cp++;
+      for (ep=cp; *ep != '\0' && !isspace(*ep); ep++);
+      if (ep == cp) {
+	if (with_alleles) Fail("Missing alleles in %s line %d\n", filename, num_snps+1);
+	break;
+      }
+      cur->alleles[a] = arena_strndup(arena, cp, ep-cp);
+    }
+
     num_snps++;
   }
+  error_pop (&trap);
   fclose(f);
 
-  free(buf);
-  buf=MallocOrDie(sizeof(char)*(num_snps*4 + 256));
+  *num_snps_r = num_snps;
+  return(start);
+}
+
+snp_t *read_genotypes (char *filename, int num_threads, arena_t *arena) {
+  snp_t *start, *cur;
+  snp_t ** volatile snp_index = NULL;
+  FILE * volatile f = NULL;
+  error_trap_t trap;
+  char *buf;
+  int num_snps = 0, num_indivs = 0;
+  int i, s, kept;
+  struct stat st;
+  ped_loader_t ld;
+  pthread_t reader;
+  pthread_t *workers;
+
+  if (num_threads < 1) num_threads = 1;
+
+  buf = MallocOrDie(strlen(filename) + 16);
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    if (f != NULL) fclose(f);
+    if (snp_index != NULL) free(snp_index);
+    free(buf);
+    error_rethrow ();
+  }
+  sprintf (buf, "%s.map", filename);
+  start = read_map (buf, 0, arena, &num_snps);
+
+  snp_index = MallocOrDie(sizeof(snp_t *)*(num_snps+1));
+  for (cur=start, s=0; cur != NULL; cur = cur->next, s++) {
+    snp_index[s] = cur;
+  }
 
   sprintf (buf, "%s.ped", filename);
   f = fopen(buf, "r");
-  if (f==NULL) Die("Cannot open %s\n", buf);
+  if (f==NULL) Fail("Cannot open %s\n", buf);
+  if (fstat(fileno(f), &st) != 0) Fail("Cannot stat %s\n", buf);
 
- 
+  /* Set up the loader and matrix, then run the pipeline */
+  ld.f = f;
+  ld.filename = buf;
+  ld.num_snps = num_snps;
+  ld.snp_index = snp_index;
+  ld.max_indivs = (int)(st.st_size / (4*(long long)num_snps + 12)) + 1;
+  ld.gt_matrix = arena_alloc(arena, sizeof(char)*(long long)num_snps*ld.max_indivs);
+  ld.ids = arena_alloc(arena, sizeof(char *)*ld.max_indivs);
+  ld.arena = arena;
+  ld.error[0] = '\0';
+  ld.num_indivs = 0;
+  pthread_mutex_init (&ld.lock, NULL);
+  pthread_cond_init (&ld.not_empty, NULL);
+  pthread_cond_init (&ld.not_full, NULL);
+  ld.head = ld.tail = NULL;
+  ld.queued = 0;
+  ld.max_queued = 2*num_threads;
+  ld.done = 0;
 
-  while (fgets(buf, num_snps*4 + 254, f)) {
-    for (cp=buf; *cp != 0 && *cp != '\n'; cp++);
-    if (*cp == 0) {
-      fprintf (stderr, "Length of %d\n", (int)(cp-buf));
-      Die("Didn't read entire line\n");
-    } else {
-      /*      fprintf (stderr, "Did a line\n");*/
-    }
-    num_indivs++;
+  workers = MallocOrDie(sizeof(pthread_t)*num_threads);
+  if (pthread_create (&reader, NULL, &ped_reader, &ld) != 0) Die("Could not start reader thread\n");
+  for (i=0; i<num_threads; i++) {
+    if (pthread_create (&workers[i], NULL, &ped_parser, &ld) != 0) Die("Could not start parser thread\n");
+  }
+  pthread_join (reader, NULL);
+  for (i=0; i<num_threads; i++) {
+    pthread_join (workers[i], NULL);
   }
-  rewind(f);
+  fclose(f);
+  f = NULL;
+  pthread_mutex_destroy (&ld.lock);
+  pthread_cond_destroy (&ld.not_empty);
+  pthread_cond_destroy (&ld.not_full);
+  free(workers);
+  if (ld.error[0] != '\0') Fail("%s", ld.error);
+  num_indivs = ld.num_indivs;
+
+  for (s=0; s<num_snps; s++) {
+    cur = snp_index[s];
+    cur->num_indivs = num_indivs;
+    cur->num_snps = num_snps;
+    cur->id_list = ld.ids;
+    cur->gt = ld.gt_matrix + (long long)s*ld.max_indivs;
+  }
+
+  recode_snps (snp_index, 0, num_snps, num_indivs, num_threads, NULL, 0);
+
+  /* Unlink the sites that could not be coded */
+  kept = drop_skipped (snp_index, 0, num_snps);
+  if (kept == 0) Fail("No snps in %s could be coded\n", buf);
+  if (kept < num_snps) fprintf (stderr, "Skipped %d of %d snps that could not be coded\n", num_snps - kept, num_snps);
+  for (s=0; s<kept; s++) {
+    snp_index[s]->num_snps = kept;
+    snp_index[s]->next = (s+1 < kept) ? snp_index[s+1] : NULL;
+  }
+  start = snp_index[0];
+  error_pop (&trap);
+
+  free(snp_index);
+  free(buf);
+  return(start);
+}
+
+/*
+ * Out-of-core access to a SNP-major PLINK binary fileset (.bed/.bim/.fam).
+ * Only the SNP metadata and the current block's genotypes are held in
+ * memory.  While one block is being tested, a background thread reads the
+ * raw records of the next one, and the block after that is hinted to the
+ * kernel with posix_fadvise so the disk stays busy.
+ */
+struct _gt_stream_t {
+  FILE *f;
+  snp_t **snp_index;
+  int num_snps;
+  int num_indivs;
+  int block_size;
+  int num_threads;
+  long long bytes_per_snp;
+
+  unsigned char *raw[2];     /* Raw .bed records, double buffered */
+  int raw_first[2];
+  int raw_count[2];
+  int fill;                  /* Buffer the prefetch thread is filling */
+  int pending;               /* Prefetch thread running */
+  int short_read;            /* Set by the prefetch thread */
+  pthread_t prefetch;
+
+  char *gt_block;            /* Recoded genotypes of the current block */
+  int cur_first, cur_count;  /* Current block, for release */
+};
 
-  ids = MallocOrDie(sizeof(char *)*num_indivs);
-  cur_id = 0;
+static void *stream_prefetch (void *arg) {
+  gt_stream_t *gs = (gt_stream_t *)arg;
+  int b = gs->fill;
+  size_t want;
+  off_t ahead;
 
-  while (fgets(buf, num_snps*4 + 254, f)) {
+  want = (size_t)(gs->raw_count[b]*gs->bytes_per_snp);
+  if (fread (gs->raw[b], 1, want, gs->f) != want) {
+    gs->short_read = 1;
+    return(NULL);
+  }
+  ahead = 3 + (off_t)(gs->raw_first[b] + gs->raw_count[b])*gs->bytes_per_snp;
+  posix_fadvise (fileno(gs->f), ahead, (off_t)gs->block_size*gs->bytes_per_snp, POSIX_FADV_WILLNEED);
+  return(NULL);
+}
+
+static void stream_start_prefetch (gt_stream_t *gs, int first) {
+  int b;
+
+  if (first >= gs->num_snps) return;
+  b = 1 - gs->fill;
+  gs->fill = b;
+  gs->raw_first[b] = first;
+  gs->raw_count[b] = gs->num_snps - first < gs->block_size ? gs->num_snps - first : gs->block_size;
+  if (pthread_create (&gs->prefetch, NULL, &stream_prefetch, gs) != 0) Die("Could not start prefetch thread\n");
+  gs->pending = 1;
+}
+
+/* Reads the .bim and .fam files of a binary fileset.  SNPs come back with
+   no genotypes; get them a block at a time through gt_stream_next */
+snp_t *read_bed_metadata (char *prefix, arena_t *arena) {
+  snp_t *start, *cur;
+  FILE * volatile f = NULL;
+  char ** volatile ids = NULL;
+  error_trap_t trap;
+  char *fname;
+  char buf[1024];
+  char *cp;
+  char **id_list;
+  int num_snps, num_indivs, max_ids, i;
+
+  fname = MallocOrDie(strlen(prefix) + 16);
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    if (f != NULL) fclose(f);
+    if (ids != NULL) free(ids);
+    free(fname);
+    error_rethrow ();
+  }
+  sprintf (fname, "%s.bim", prefix);
+  start = read_map (fname, 1, arena, &num_snps);
+  if (start == NULL) Fail("No snps in %s\n", fname);
+
+  sprintf (fname, "%s.fam", prefix);
+  f = fopen(fname, "r");
+  if (f==NULL) Fail("Cannot open %s\n", fname);
+  max_ids = 1024;
+  ids = MallocOrDie(sizeof(char *)*max_ids);
+  num_indivs = 0;
+  while (fgets(buf, 1023, f)) {
+    if (buf[0] == '\n') continue;
+    if (num_indivs == max_ids) {
+      max_ids *= 2;
+      ids = ReallocOrDie(ids, sizeof(char *)*max_ids);
+    }
     cp = buf;
     while (!isspace(*cp)) cp++;
     while (isspace(*cp)) cp++;
     while (!isspace(*cp)) cp++;
-    ids[cur_id] = MallocOrDie((sizeof(char)*(cp-buf))+1);
-    strncpy(ids[cur_id], buf, cp-buf);
-    ids[cur_id][cp-buf] = '\0';
+    ids[num_indivs] = arena_strndup(arena, buf, cp-buf);
+    num_indivs++;
+  }
+  id_list = arena_alloc(arena, sizeof(char *)*(num_indivs+1));
+  memcpy (id_list, ids, sizeof(char *)*num_indivs);
+  error_pop (&trap);
+  fclose(f);
+  free(ids);
+  free(fname);
 
-    while (isspace(*cp)) cp++;
-    while (!isspace(*cp)) cp++;
-    while (isspace(*cp)) cp++;
-    while (!isspace(*cp)) cp++;
-    while (isspace(*cp)) cp++;
-    while (!isspace(*cp)) cp++;
-    while (isspace(*cp)) cp++;
-    while (!isspace(*cp)) cp++;
-    while (isspace(*cp)) cp++;
+  for (cur=start, i=0; cur != NULL; cur = cur->next, i++) {
+    cur->num_indivs = num_indivs;
+    cur->num_snps = num_snps;
+    cur->id_list = id_list;
+  }
+  return(start);
+}
 
-    /* Now, we're at the gt's */
-    for (cur=start; cur != NULL; cur = cur->next) {
-      if (cur->gt == NULL) {
-	cur->gt = MallocOrDie(sizeof(char)*num_indivs);
-      }
-      cur->gt[cur_id] = get_gt_code(cp);
-      while (!isspace(*cp)) cp++;
-      while (isspace(*cp)) cp++;
-      while (!isspace(*cp)) cp++;
-      while (isspace(*cp)) cp++;
+gt_stream_t *gt_stream_open (char *prefix, snp_t *genotypes, int block_size, int num_threads) {
+  gt_stream_t *gs;
+  snp_t *cur;
+  error_trap_t trap;
+  char *fname;
+  unsigned char magic[3];
+  int s;
+
+  gs = MallocOrDie(sizeof(gt_stream_t));
+  gs->f = NULL;
+  gs->raw[0] = gs->raw[1] = NULL;
+  gs->gt_block = NULL;
+  gs->cur_first = 0;
+  gs->cur_count = 0;
+  gs->pending = 0;
+  gs->num_snps = genotypes->num_snps;
+  gs->num_indivs = genotypes->num_indivs;
+  gs->block_size = block_size < gs->num_snps ? block_size : gs->num_snps;
+  gs->num_threads = num_threads < 1 ? 1 : num_threads;
+  gs->bytes_per_snp = (gs->num_indivs + 3) / 4;
+
+  gs->snp_index = MallocOrDie(sizeof(snp_t *)*(gs->num_snps+1));
+  for (cur=genotypes, s=0; cur != NULL; cur = cur->next, s++) {
+    gs->snp_index[s] = cur;
+  }
+
+  fname = MallocOrDie(strlen(prefix) + 16);
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    free(fname);
+    gt_stream_close (gs);
+    error_rethrow ();
+  }
+  sprintf (fname, "%s.bed", prefix);
+  gs->f = fopen(fname, "rb");
+  if (gs->f == NULL) Fail("Cannot open %s\n", fname);
+  if (fread (magic, 1, 3, gs->f) != 3 || magic[0] != 0x6c || magic[1] != 0x1b) {
+    Fail("%s is not a PLINK .bed file\n", fname);
+  }
+  if (magic[2] != 0x01) Fail("%s is not in SNP-major mode\n", fname);
+
+  gs->raw[0] = mem_alloc(MEM_GENOTYPES, sizeof(unsigned char)*gs->block_size*gs->bytes_per_snp);
+  gs->raw[1] = mem_alloc(MEM_GENOTYPES, sizeof(unsigned char)*gs->block_size*gs->bytes_per_snp);
+  gs->gt_block = mem_alloc(MEM_GENOTYPES, sizeof(char)*(long long)gs->block_size*gs->num_indivs);
+  error_pop (&trap);
+  free(fname);
+  gs->short_read = 0;
+  gs->fill = 1;
+
+  stream_start_prefetch (gs, 0);
+  return(gs);
+}
+
+/*
+ * Releases the previous block and makes the next one current: waits for
+ * its raw records, starts the prefetch of the following block, then
+ * decodes and recodes in parallel.  Sets *block_r to the block's SNPs and
+ * returns how many there are, 0 at the end of the file.  Sites that
+ * cannot be coded are left out of the block.
+ */
+int gt_stream_next (gt_stream_t *gs, snp_t ***block_r) {
+  int b, s, first, count;
+
+  for (s=gs->cur_first; s<gs->cur_first+gs->cur_count; s++) {
+    gs->snp_index[s]->gt = NULL;
+  }
+  gs->cur_count = 0;
+
+  /* A block whose sites were all skipped is passed over */
+  do {
+    if (!gs->pending) return(0);
+    pthread_join (gs->prefetch, NULL);
+    gs->pending = 0;
+    b = gs->fill;
+    if (gs->short_read) Fail("Short read from .bed file at snp %d\n", gs->raw_first[b]);
+    first = gs->raw_first[b];
+    count = gs->raw_count[b];
+    stream_start_prefetch (gs, first + count);
+
+    for (s=0; s<count; s++) {
+      gs->snp_index[first+s]->gt = gs->gt_block + (long long)s*gs->num_indivs;
     }
+    recode_snps (gs->snp_index, first, first+count, gs->num_indivs, gs->num_threads, gs->raw[b], gs->bytes_per_snp);
+    count = drop_skipped (gs->snp_index, first, first+count);
+  } while (count == 0);
+
+  gs->cur_first = first;
+  gs->cur_count = count;
+  *block_r = gs->snp_index + first;
+  return(count);
+}
+
+void gt_stream_close (gt_stream_t *gs) {
+  int s;
+
+  if (gs->pending) pthread_join (gs->prefetch, NULL);
+  for (s=gs->cur_first; s<gs->cur_first+gs->cur_count; s++) {
+    gs->snp_index[s]->gt = NULL;
+  }
+  if (gs->f != NULL) fclose(gs->f);
+  mem_free(gs->raw[0]);
+  mem_free(gs->raw[1]);
+  mem_free(gs->gt_block);
+  free(gs->snp_index);
+  free(gs);
+}
 
-    cur_id++;
+/*
+ * Makes a copy of the SNPs that are to be tested (gt not NULL) restricted
+ * to the individuals in keep, for a dataset with only some of the
+ * genotyped samples.  Genotype classes are renumbered as recode_gt would
+ * have coded the subset, and SNPs left with a single class are dropped.
+ * geno_counts keeps the full panel's counts, which QC has already used.
+ * The copy, with its own gt matrix and id_list, comes from arena.
+ */
+snp_t *gather_genotypes (snp_t *genotypes, int *keep, int num_kept, arena_t *arena) {
+  snp_t *view, *cur, *dst;
+  char *matrix, *gt;
+  char **ids;
+  int num_snps, n, i, g, k;
+  int counts[3];
+  char map[3];
+
+  num_snps = 0;
+  for (cur = genotypes; cur != NULL; cur = cur->next) {
+    if (cur->gt != NULL) num_snps++;
   }
+  if (num_snps == 0) Fail("No snps to gather\n");
+  view = arena_alloc(arena, sizeof(snp_t)*num_snps);
+  matrix = arena_alloc(arena, sizeof(char)*num_snps*(size_t)num_kept);
+  ids = arena_alloc(arena, sizeof(char *)*(num_kept+1));
+  for (i=0; i<num_kept; i++) ids[i] = genotypes->id_list[keep[i]];
 
+  n = 0;
+  for (cur = genotypes; cur != NULL; cur = cur->next) {
+    if (cur->gt == NULL) continue;
+    gt = matrix + (size_t)n*num_kept;
+    counts[0] = counts[1] = counts[2] = 0;
+    for (i=0; i<num_kept; i++) {
+      gt[i] = cur->gt[keep[i]];
+      if (gt[i] >= 0 && gt[i] <= 2) counts[(int)gt[i]]++;
+    }
+    k = 0;
+    for (g=0; g<3; g++) {
+      map[g] = (char)k;
+      if (counts[g] > 0) k++;
+    }
+    if (k < 2) continue;
+    if (k < cur->num_groups) {
+      for (i=0; i<num_kept; i++) {
+	if (gt[i] != 127) gt[i] = map[(int)gt[i]];
+      }
+    }
 
-  for (cur=start; cur!=NULL; cur = cur->next) {
-    cur->num_indivs = num_indivs;
-    cur->num_snps = num_snps;
-    cur->id_list = ids;
-    /*printf ("Recoding a gt rs%d\n", cur->rs);*/
-    cur->num_groups = recode_gt (cur->gt, num_indivs);
-    /*check_recoded_gt (cur->gt, num_indivs, cur->num_groups);*/
+    dst = &view[n];
+    *dst = *cur;
+    dst->gt = gt;
+    dst->id_list = ids;
+    dst->num_indivs = num_kept;
+    dst->num_groups = k;
+    dst->dup_rep = NULL;
+    dst->dup_next = NULL;
+    dst->next = NULL;
+    if (n > 0) view[n-1].next = dst;
+    n++;
   }
-  free(buf);
-  return(start);
+  if (n == 0) Fail("No snps vary among the %d individuals of this dataset\n", num_kept);
+  for (i=0; i<n; i++) view[i].num_snps = n;
+  return(view);
 }
 
 int val_sort_func (const void *a, const void *b) {
@@ -378,10 +975,10 @@ void quantile_normalize (float *vals, int n) {
   for (i=0; i<n; i++) {
     *(sort_index[i]) = (float)gsl_cdf_ugaussian_Pinv((double)((i+0.5)*increment));
   }
-
+  free(sort_index);
 }
 
-phen_t *read_phenotypes (char *probelist, char *probedir, int num_indivs, char **id_list, int qnorm) {
+phen_t *read_phenotypes (char *probelist, char *probedir, int num_indivs, char **id_list, int qnorm, arena_t *arena) {
   char buf[256];
   FILE *f;
   phen_t *start, *cur, *prev;
@@ -393,10 +990,10 @@ phen_t *read_phenotypes (char *probelist, char *probedir, int num_indivs, char *
   prev = NULL;
 
   f = fopen(probelist, "r");
-  if (f==NULL) Die("Cannot open %s\n", probelist);
+  if (f==NULL) Fail("Cannot open %s\n", probelist);
   
   while (fgets(buf, 255, f)) {
-    cur = MallocOrDie(sizeof(phen_t));
+    cur = arena_alloc(arena, sizeof(phen_t));
     if (start == NULL) {
       start = cur;
     } else {
@@ -407,8 +1004,7 @@ phen_t *read_phenotypes (char *probelist, char *probedir, int num_indivs, char *
     /* Initial copy of name */
     for (cp=buf; !isspace(*cp); cp++);
     *cp = '\0';
-    cur->name = MallocOrDie(sizeof(char)*(strlen(buf)+1));
-    strncpy(cur->name, buf, strlen(buf)+1);
+    cur->name = arena_strndup(arena, buf, strlen(buf));
  
     /* Set chr, start stop */
     cp++;
@@ -423,11 +1019,18 @@ phen_t *read_phenotypes (char *probelist, char *probedir, int num_indivs, char *
     while (!isspace(*cp)) cp++;
     while (isspace(*cp)) cp++;
     cur->stop = atoi(cp);
+    while (*cp != '\0' && !isspace(*cp)) cp++;
+    while (isspace(*cp)) cp++;
+    cur->gene = NULL;
+    if (*cp != '\0') {
+      for (i=0; cp[i] != '\0' && !isspace(cp[i]); i++);
+      cur->gene = arena_strndup(arena, cp, i);
+    }
 
     for (cp=cur->name; *cp != '\0' && !isspace(*cp) && isprint (*cp); cp++);
     *cp = '\0';
     
-    cur->values = MallocOrDie (sizeof(float)*num_indivs);
+    cur->values = arena_alloc(arena, sizeof(float)*num_indivs);
     for (i=0; i<num_indivs; i++) {
       cur->values[i] = 0;
     }
@@ -442,7 +1045,7 @@ phen_t *read_phenotypes (char *probelist, char *probedir, int num_indivs, char *
       for (cp=buf; *cp != '\0'; cp++) {
 	fprintf (stderr, "%c %d\n", *cp, (int)(*cp));
       }
-      Die("Could not open %s b/c of %d\n", buf, errno);
+      Fail("Could not open %s b/c of %d\n", buf, errno);
     }
     tot_read = 0;
     while (fgets (buf, 255, f)) {
@@ -460,8 +1063,198 @@ phen_t *read_phenotypes (char *probelist, char *probedir, int num_indivs, char *
       } 
     }
     fclose(f);
-    if (tot_read < num_indivs) Die("Not enough individuals in %s\n", cur->name);
+    if (tot_read < num_indivs) Fail("Not enough individuals in %s\n", cur->name);
     if (qnorm == 1) quantile_normalize(cur->values, num_indivs);
   }
   return(start);
 }
+
+/*
+ * Reads a covariate for the interaction test, one "<FID> <IID> <value>"
+ * line per individual as in a .phen file, and centers and scales it.
+ */
+float *read_covariate (char *filename, int num_indivs, char **id_list, arena_t *arena) {
+  char buf[256];
+  FILE *f;
+  float *cov;
+  char *found;
+  char *cp;
+  double mean = 0., var = 0., sd;
+  int i, tot_read = 0;
+
+  f = fopen(filename, "r");
+  if (f == NULL) Fail("Cannot open covariate file %s\n", filename);
+  cov = arena_alloc(arena, sizeof(float)*num_indivs);
+  found = arena_alloc(arena, num_indivs);
+  memset (found, 0, num_indivs);
+  while (fgets (buf, 255, f)) {
+    for (i=0; i < num_indivs && strncmp(id_list[i], buf, strlen(id_list[i])) != 0; i++);
+    if (i == num_indivs || found[i]) continue;
+    cp = buf + strlen(id_list[i]);
+    while (isspace(*cp)) cp++;
+    if (!isdigit(*cp) && *cp != '-' && *cp != '.') {
+      fclose(f);
+      Fail("Non-number covariate in %s line %s", filename, buf);
+    }
+    cov[i] = atof(cp);
+    found[i] = 1;
+    tot_read++;
+  }
+  fclose(f);
+  if (tot_read < num_indivs) Fail("Covariate file %s has %d of %d individuals\n", filename, tot_read, num_indivs);
+
+  for (i=0; i<num_indivs; i++) mean += cov[i];
+  mean /= num_indivs;
+  for (i=0; i<num_indivs; i++) var += (cov[i]-mean)*(cov[i]-mean);
+  sd = sqrt(var/num_indivs);
+  if (sd == 0.) Fail("Covariate in %s is constant\n", filename);
+  for (i=0; i<num_indivs; i++) cov[i] = (float)((cov[i]-mean)/sd);
+  return(cov);
+}
+
+/*
+ * Reads a --keep list, one "<FID> <IID>" line per individual to analyze,
+ * separated as in the genotype files.  Returns a mask over id_list and
+ * sets *num_r to the number of genotyped individuals it names.
+ */
+char *read_keep_list (char *filename, int num_indivs, char **id_list, int *num_r) {
+  char buf[256];
+  FILE *f;
+  char *mask;
+  size_t len;
+  int i, n = 0;
+
+  f = fopen(filename, "r");
+  if (f == NULL) Fail("Cannot open keep list %s\n", filename);
+  mask = MallocOrDie(sizeof(char)*(num_indivs+1));
+  memset (mask, 0, num_indivs);
+  while (fgets (buf, 255, f)) {
+    for (i=0; i<num_indivs; i++) {
+      len = strlen(id_list[i]);
+      if (strncmp(id_list[i], buf, len) == 0 && (buf[len] == '\0' || isspace(buf[len]))) break;
+    }
+    if (i < num_indivs && !mask[i]) {
+      mask[i] = 1;
+      n++;
+    }
+  }
+  fclose(f);
+  *num_r = n;
+  return(mask);
+}
+
+/*
+ * Finds which genotyped individuals a dataset covers: those in the .phen
+ * file of every probe in probelist, matching IDs as read_phenotypes does.
+ * With a mask, only individuals it has set count.  Returns their indices
+ * in id_list, in genotype order.
+ */
+int *dataset_individuals (char *probelist, char *probedir, int num_indivs, char **id_list, char *mask, int *num_kept_r) {
+  char buf[256], line[256];
+  char *fname;
+  int *count, *seen;
+  int *keep;
+  FILE *f;
+  FILE *volatile pf = NULL;
+  error_trap_t trap;
+  int i, n, num_probes = 0;
+
+  f = fopen(probelist, "r");
+  if (f == NULL) Fail("Cannot open %s\n", probelist);
+  fname = MallocOrDie(sizeof(char)*(strlen(probedir)+sizeof(buf)+7));
+  count = MallocOrDie(sizeof(int)*(num_indivs+1));
+  seen = MallocOrDie(sizeof(int)*(num_indivs+1));
+  for (i=0; i<num_indivs; i++) {
+    count[i] = 0;
+    seen[i] = -1;
+  }
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    if (pf != NULL) fclose(pf);
+    fclose(f);
+    free(fname);
+    free(count);
+    free(seen);
+    error_rethrow ();
+  }
+
+  /* count[i] is the number of probes with individual i; seen[i] keeps a
+     probe listing someone twice from counting twice */
+  while (fgets(buf, 255, f)) {
+    for (i=0; buf[i] != '\0' && !isspace(buf[i]); i++);
+    buf[i] = '\0';
+    sprintf (fname, "%s/%s.phen", probedir, buf);
+    pf = fopen(fname, "r");
+    if (pf == NULL) Fail("Could not open %s b/c of %d\n", fname, errno);
+    while (fgets (line, 255, pf)) {
+      for (i=0; i < num_indivs && strncmp(id_list[i], line, strlen(id_list[i])) != 0; i++);
+      if (i < num_indivs && seen[i] != num_probes) {
+	seen[i] = num_probes;
+	count[i]++;
+      }
+    }
+    fclose(pf);
+    pf = NULL;
+    num_probes++;
+  }
+  if (num_probes == 0) Fail("No probes in %s\n", probelist);
+  error_pop (&trap);
+  fclose(f);
+  free(fname);
+  free(seen);
+
+  keep = MallocOrDie(sizeof(int)*(num_indivs+1));
+  n = 0;
+  for (i=0; i<num_indivs; i++) {
+    if (count[i] == num_probes && (mask == NULL || mask[i])) keep[n++] = i;
+  }
+  free(count);
+  if (n < 3) {
+    free(keep);
+    Fail("Only %d genotyped individuals are in every probe in %s\n", n, probedir);
+  }
+  *num_kept_r = n;
+  return(keep);
+}
+
+/*
+ * Reads a manifest of datasets, one per line:
+ *   <gene list> <expression directory> [<output file>]
+ * Blank lines and lines starting with # are skipped.
+ */
+dataset_t *read_manifest (char *filename, int *num_datasets_r) {
+  char buf[4096];
+  char *tok[3];
+  dataset_t *datasets = NULL;
+  FILE *f;
+  int n = 0, k;
+
+  f = fopen(filename, "r");
+  if (f == NULL) Fail("Cannot open manifest %s\n", filename);
+  while (fgets(buf, sizeof(buf), f)) {
+    tok[0] = strtok(buf, " \t\r\n");
+    if (tok[0] == NULL || tok[0][0] == '#') continue;
+    for (k=1; k<3; k++) tok[k] = strtok(NULL, " \t\r\n");
+    if (tok[1] == NULL) Fail("Manifest %s line %d needs a gene list and an expression directory\n", filename, n+1);
+    datasets = ReallocOrDie(datasets, sizeof(dataset_t)*(n+1));
+    datasets[n].gene_list = sre_strdup(tok[0], -1);
+    datasets[n].exp_dir = sre_strdup(tok[1], -1);
+    datasets[n].out_file = (tok[2] != NULL) ? sre_strdup(tok[2], -1) : NULL;
+    n++;
+  }
+  fclose(f);
+  if (n == 0) Fail("No datasets in manifest %s\n", filename);
+  *num_datasets_r = n;
+  return(datasets);
+}
+
+void free_manifest (dataset_t *datasets, int num_datasets) {
+  int d;
+
+  for (d=0; d<num_datasets; d++) {
+    free(datasets[d].gene_list);
+    free(datasets[d].exp_dir);
+    if (datasets[d].out_file != NULL) free(datasets[d].out_file);
+  }
+  free(datasets);
+}
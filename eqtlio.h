@@ -8,9 +8,27 @@
 #define _eqtlio_h
 
 #include "structs.h"
+#include "arena.h"
 
-snp_t *read_genotypes (char *filename);
+typedef struct _gt_stream_t gt_stream_t;
 
-phen_t *read_phenotypes (char *probelist, char *probedir, int num_indivs, char **id_list, int qnorm);
+snp_t *read_genotypes (char *filename, int num_threads, arena_t *arena);
+
+snp_t *read_bed_metadata (char *prefix, arena_t *arena);
+gt_stream_t *gt_stream_open (char *prefix, snp_t *genotypes, int block_size, int num_threads);
+int gt_stream_next (gt_stream_t *gs, snp_t ***block_r);
+void gt_stream_close (gt_stream_t *gs);
+
+snp_t *gather_genotypes (snp_t *genotypes, int *keep, int num_kept, arena_t *arena);
+
+phen_t *read_phenotypes (char *probelist, char *probedir, int num_indivs, char **id_list, int qnorm, arena_t *arena);
+
+float *read_covariate (char *filename, int num_indivs, char **id_list, arena_t *arena);
+
+char *read_keep_list (char *filename, int num_indivs, char **id_list, int *num_r);
+
+int *dataset_individuals (char *probelist, char *probedir, int num_indivs, char **id_list, char *mask, int *num_kept_r);
+dataset_t *read_manifest (char *filename, int *num_datasets_r);
+void free_manifest (dataset_t *datasets, int num_datasets);
 
 #endif
@@ -0,0 +1,60 @@
+/*
+ * error.c
+ *
+ * Error traps, one stack per thread.  Only the thread that set a trap
+ * can unwind to it, so worker threads set traps of their own, record the
+ * message and let the thread that started them call Fail() after the
+ * join.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "error.h"
+
+#define ERROR_MSG_SIZE 1024
+
+static __thread error_trap_t *cur_trap = NULL;
+static __thread char error_msg[ERROR_MSG_SIZE];
+
+void error_push (error_trap_t *trap) {
+  trap->prev = cur_trap;
+  cur_trap = trap;
+}
+
+void error_pop (error_trap_t *trap) {
+  cur_trap = trap->prev;
+}
+
+static void error_unwind (void) {
+  error_trap_t *trap;
+
+  if (cur_trap == NULL) Die("%s", error_msg);
+  trap = cur_trap;
+  cur_trap = trap->prev;
+  longjmp (trap->env, 1);
+}
+
+void Fail (char *format, ...) {
+  va_list ap;
+
+  va_start (ap, format);
+  vsnprintf (error_msg, ERROR_MSG_SIZE, format, ap);
+  va_end (ap);
+  error_unwind ();
+}
+
+/* Passes the last Fail() on to the next trap out, for a trap that only
+   cleans up */
+void error_rethrow (void) {
+  error_unwind ();
+}
+
+/* The message of the last Fail() in this thread */
+char *error_message (void) {
+  return(error_msg);
+}
@@ -0,0 +1,37 @@
+/*
+ * error.h
+ *
+ * Recoverable errors.  Fail() reports like squid's Die() and exits,
+ * unless the calling thread has an error trap set, in which case it
+ * unwinds to the trap and keeps the message for error_message().
+ */
+
+#ifndef _error_h
+#define _error_h
+
+#include <setjmp.h>
+
+typedef struct _error_trap_t {
+  jmp_buf env;
+  struct _error_trap_t *prev;
+} error_trap_t;
+
+/*
+ * Usage:
+ *   error_push (&trap);
+ *   if (setjmp(trap.env) != 0) { ... clean up; return(error); }
+ *   ...
+ *   error_pop (&trap);
+ * Fail() pops the trap before jumping to it.
+ */
+void error_push (error_trap_t *trap);
+
+void error_pop (error_trap_t *trap);
+
+void Fail (char *format, ...);
+
+void error_rethrow (void);
+
+char *error_message (void);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * gene.c
+ *
+ * Gene-level cis analysis.  Arrays often carry several probes per gene;
+ * grouping them lets the scan look up a gene's cis window and compute
+ * each SNP's genotype sums once for all of its probes.  The gene's
+ * p-value is the smallest over its probes and cis SNPs, Sidak corrected
+ * for the number of SNP-probe tests behind it, so that genes can then be
+ * compared with each other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "structs.h"
+#include "gene.h"
+
+static __thread phen_t **sort_phens;    /* For gene_sort_func */
+
+static char *gene_key (phen_t *phen) {
+  return(phen->gene != NULL ? phen->gene : phen->name);
+}
+
+/* By gene, then chromosome, then list order */
+static int gene_sort_func (const void *a, const void *b) {
+  int i, j, c;
+
+  i = *((int *)a);
+  j = *((int *)b);
+  c = strcmp(gene_key(sort_phens[i]), gene_key(sort_phens[j]));
+  if (c != 0) return(c);
+  if (sort_phens[i]->chr != sort_phens[j]->chr) return(sort_phens[i]->chr < sort_phens[j]->chr ? -1 : 1);
+  return(i < j ? -1 : (i > j));
+}
+
+/* Genes in the order of their first probe */
+static int gene_order_func (const void *a, const void *b) {
+  gene_t *i, *j;
+
+  i = (gene_t *)a;
+  j = (gene_t *)b;
+  return(i->probes[0] < j->probes[0] ? -1 : (i->probes[0] > j->probes[0]));
+}
+
+/*
+ * Groups the probes by gene and chromosome.  A probe without a gene
+ * column is a gene of its own.
+ */
+gene_t *gene_groups (phen_t **phens, int num_phens, int *num_genes_r) {
+  gene_t *genes;
+  gene_t *g;
+  phen_t *phen;
+  int *order;
+  int num_genes = 0;
+  int i, k, lo, hi;
+
+  order = MallocOrDie(sizeof(int)*(num_phens+1));
+  for (i=0; i<num_phens; i++) order[i] = i;
+  sort_phens = phens;
+  qsort (order, num_phens, sizeof(int), &gene_sort_func);
+  sort_phens = NULL;
+
+  genes = MallocOrDie(sizeof(gene_t)*(num_phens+1));
+  for (i=0; i<num_phens; i=k) {
+    for (k=i+1; k<num_phens &&
+	   strcmp(gene_key(phens[order[k]]), gene_key(phens[order[i]])) == 0 &&
+	   phens[order[k]]->chr == phens[order[i]]->chr; k++);
+    g = &genes[num_genes++];
+    g->name = gene_key(phens[order[i]]);
+    g->chr = phens[order[i]]->chr;
+    g->num_probes = k - i;
+    g->probes = MallocOrDie(sizeof(int)*g->num_probes);
+    memcpy (g->probes, order + i, sizeof(int)*g->num_probes);
+    g->lo = g->hi = phens[order[i]]->start;
+    for (k=i; k<i+g->num_probes; k++) {
+      phen = phens[order[k]];
+      lo = phen->start < phen->stop ? phen->start : phen->stop;
+      hi = phen->start < phen->stop ? phen->stop : phen->start;
+      if (lo < g->lo) g->lo = lo;
+      if (hi > g->hi) g->hi = hi;
+    }
+    g->num_tests = 0;
+    g->min_p = 2.;
+    g->best_snp = NULL;
+    g->best_phen = NULL;
+  }
+  free(order);
+  qsort (genes, num_genes, sizeof(gene_t), &gene_order_func);
+
+  *num_genes_r = num_genes;
+  return(genes);
+}
+
+/* Counts one test of the gene; a gene is only ever scanned by one thread
+   at a time.  A negative p means no test was possible */
+void gene_update (gene_t *gene, snp_t *snp, phen_t *phen, double p) {
+  if (p < 0.) return;
+  gene->num_tests++;
+  if (p < gene->min_p) {
+    gene->min_p = p;
+    gene->best_snp = snp;
+    gene->best_phen = phen;
+  }
+}
+
+/* The best p over the gene's tests, Sidak corrected for their number:
+   1 - (1 - min_p)^num_tests.  SNPs in LD make this conservative */
+double gene_p (gene_t *gene) {
+  if (gene->num_tests == 0 || gene->min_p >= 1.) return(1.);
+  return(-expm1((double)gene->num_tests * log1p(-gene->min_p)));
+}
+
+void gene_free (gene_t *genes, int num_genes) {
+  int i;
+
+  if (genes == NULL) return;
+  for (i=0; i<num_genes; i++) {
+    free(genes[i].probes);
+  }
+  free(genes);
+}
@@ -0,0 +1,38 @@
+/*
+ * gene.h
+ *
+ * Gene-level cis analysis.  Probes with the same gene (fifth column of
+ * the gene list) on the same chromosome are scanned together, and each
+ * gene reports its best SNP-probe pair with the p-value corrected for
+ * the number of SNP-probe tests.
+ */
+
+#ifndef _gene_h
+#define _gene_h
+
+#include "structs.h"
+
+typedef struct _gene_t {
+  char *name;                   /* A probe's name if it has no gene */
+  char chr;
+  int lo;                       /* Smallest probe start or stop */
+  int hi;                       /* Largest probe start or stop */
+  int *probes;                  /* Indices into the scan's probe array */
+  int num_probes;
+
+  /* Filled in by the scan */
+  long long num_tests;
+  double min_p;
+  snp_t *best_snp;
+  phen_t *best_phen;
+} gene_t;
+
+gene_t *gene_groups (phen_t **phens, int num_phens, int *num_genes_r);
+
+void gene_update (gene_t *gene, snp_t *snp, phen_t *phen, double p);
+
+double gene_p (gene_t *gene);
+
+void gene_free (gene_t *genes, int num_genes);
+
+#endif
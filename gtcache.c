@@ -0,0 +1,324 @@
+/*
+ * gtcache.c
+ *
+ * Binary cache of a recoded .ped/.map panel in <prefix>.gtc:
+ *
+ *   header      magic, version, byte order check, size/mtime of the .ped
+ *               and .map, a hash of the first and last blocks of each,
+ *               dimensions, offsets
+ *   snps        chr, pos, rs, num_groups and geno_counts per SNP
+ *   ids         individual IDs, each NUL terminated
+ *   genotypes   SNP-major matrix of recoded calls, one byte each, page
+ *               aligned
+ *
+ * A cache is used only if its version matches, its sections fit in the
+ * file, and the .ped and .map have the size, mtime and hash it was made
+ * from.  Only the ends of the inputs are hashed, so checking a cache does
+ * not read a multi-GB .ped: an edit in the middle that keeps the size
+ * and also restores the nanosecond mtime goes unnoticed.  The cache is
+ * mapped rather than read, so gt and id_list point straight into the
+ * mapping and a rerun starts scanning without touching the genotypes
+ * first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "structs.h"
+#include "gtcache.h"
+#include "arena.h"
+
+#define GT_CACHE_MAGIC "EQTLGTC"
+#define GT_CACHE_BYTE_ORDER 0x01020304
+#define GT_CACHE_ALIGN 4096
+#define GT_CACHE_EDGE (1 << 20)         /* Bytes hashed at each end of an input */
+
+typedef struct _gt_cache_header_t {
+  char magic[8];
+  int version;
+  int byte_order;
+  long long ped_size;
+  long long ped_mtime;          /* Nanoseconds */
+  long long map_size;
+  long long map_mtime;
+  unsigned long long edge_hash;
+  int num_snps;
+  int num_indivs;
+  long long snp_offset;
+  long long id_offset;
+  long long id_bytes;
+  long long gt_offset;
+} gt_cache_header_t;
+
+typedef struct _gt_cache_snp_t {
+  int chr;
+  int pos;
+  int rs;
+  int num_groups;
+  int geno_counts[4];
+} gt_cache_snp_t;
+
+/* FNV-1a taken a 64-bit word at a time; a trailing partial word goes in
+   a byte at a time */
+static unsigned long long fnv_update (unsigned long long h, unsigned char *buf, size_t len) {
+  unsigned long long w;
+  size_t i;
+
+  for (i=0; i+8 <= len; i+=8) {
+    memcpy (&w, buf + i, 8);
+    h ^= w;
+    h *= 1099511628211ULL;
+  }
+  for (; i<len; i++) {
+    h ^= buf[i];
+    h *= 1099511628211ULL;
+  }
+  return(h);
+}
+
+/* Hashes the first and last GT_CACHE_EDGE bytes of a file of size bytes
+   (all of it, if smaller) */
+static int hash_edges (char *filename, long long size, unsigned char *buf, unsigned long long *h) {
+  long long n;
+  int fd, ok;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) return(0);
+  n = (size < GT_CACHE_EDGE) ? size : GT_CACHE_EDGE;
+  ok = (pread(fd, buf, (size_t)n, 0) == (ssize_t)n);
+  if (ok) *h = fnv_update (*h, buf, (size_t)n);
+  if (ok && size > n) {
+    ok = (pread(fd, buf, (size_t)n, (off_t)(size - n)) == (ssize_t)n);
+    if (ok) *h = fnv_update (*h, buf, (size_t)n);
+  }
+  close(fd);
+  return(ok);
+}
+
+/* Fills in the input file fields of a header; returns 0 if the inputs
+   cannot be read */
+static int input_signature (char *prefix, gt_cache_header_t *hdr) {
+  char *ped_name, *map_name;
+  struct stat ped_st, map_st;
+  unsigned char *buf;
+  int ok = 0;
+
+  ped_name = MallocOrDie(strlen(prefix) + 8);
+  map_name = MallocOrDie(strlen(prefix) + 8);
+  sprintf (ped_name, "%s.ped", prefix);
+  sprintf (map_name, "%s.map", prefix);
+  if (stat(ped_name, &ped_st) == 0 && stat(map_name, &map_st) == 0) {
+    hdr->ped_size = (long long)ped_st.st_size;
+    hdr->ped_mtime = (long long)ped_st.st_mtim.tv_sec*1000000000LL + ped_st.st_mtim.tv_nsec;
+    hdr->map_size = (long long)map_st.st_size;
+    hdr->map_mtime = (long long)map_st.st_mtim.tv_sec*1000000000LL + map_st.st_mtim.tv_nsec;
+    buf = MallocOrDie(GT_CACHE_EDGE);
+    hdr->edge_hash = 14695981039346656037ULL;
+    ok = hash_edges (map_name, hdr->map_size, buf, &hdr->edge_hash) &&
+      hash_edges (ped_name, hdr->ped_size, buf, &hdr->edge_hash);
+    free(buf);
+  }
+  free(ped_name);
+  free(map_name);
+  return(ok);
+}
+
+/* 1 if the header's sections lie in order inside a file of size bytes,
+   with the genotype matrix running exactly to its end */
+static int layout_ok (gt_cache_header_t *hdr, long long size) {
+  long long snp_end;
+
+  if (hdr->num_snps <= 0 || hdr->num_indivs <= 0) return(0);
+  if (hdr->snp_offset < (long long)sizeof(*hdr) || hdr->snp_offset > size) return(0);
+  if ((size - hdr->snp_offset) / (long long)sizeof(gt_cache_snp_t) < hdr->num_snps) return(0);
+  snp_end = hdr->snp_offset + (long long)hdr->num_snps*sizeof(gt_cache_snp_t);
+  if (hdr->id_offset < snp_end || hdr->id_bytes < hdr->num_indivs ||
+      hdr->id_bytes > size - hdr->id_offset) return(0);
+  if (hdr->gt_offset < hdr->id_offset + hdr->id_bytes || hdr->gt_offset > size) return(0);
+  return((size - hdr->gt_offset) / hdr->num_indivs == hdr->num_snps &&
+	 (size - hdr->gt_offset) % hdr->num_indivs == 0);
+}
+
+/* 1 if the ID section holds num_indivs NUL terminated IDs */
+static int ids_ok (char *base, gt_cache_header_t *hdr) {
+  char *cp, *end, *nul;
+  int i;
+
+  cp = base + hdr->id_offset;
+  end = cp + hdr->id_bytes;
+  for (i=0; i<hdr->num_indivs; i++) {
+    nul = memchr(cp, '\0', end - cp);
+    if (nul == NULL) return(0);
+    cp = nul + 1;
+  }
+  return(1);
+}
+
+/*
+ * Returns the panel from <prefix>.gtc, or NULL if there is no cache or it
+ * does not match the current .ped/.map.  The panel and the mapping belong
+ * to arena.
+ */
+snp_t *gt_cache_load (char *prefix, arena_t *arena) {
+  gt_cache_header_t hdr, cur;
+  gt_cache_snp_t *rec;
+  snp_t *snps;
+  char **ids;
+  char *fname, *base, *cp;
+  struct stat st;
+  int fd, s, i;
+
+  fname = MallocOrDie(strlen(prefix) + 8);
+  sprintf (fname, "%s.gtc", prefix);
+  fd = open(fname, O_RDONLY);
+  if (fd < 0) {
+    free(fname);
+    return(NULL);
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(hdr) ||
+      read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+    close(fd);
+    free(fname);
+    return(NULL);
+  }
+
+  memset (&cur, 0, sizeof(cur));
+  if (memcmp(hdr.magic, GT_CACHE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != GT_CACHE_VERSION ||
+      hdr.byte_order != GT_CACHE_BYTE_ORDER ||
+      !layout_ok (&hdr, (long long)st.st_size) ||
+      !input_signature (prefix, &cur) ||
+      cur.ped_size != hdr.ped_size || cur.ped_mtime != hdr.ped_mtime ||
+      cur.map_size != hdr.map_size || cur.map_mtime != hdr.map_mtime ||
+      cur.edge_hash != hdr.edge_hash) {
+    fprintf (stderr, "Genotype cache %s is out of date; rebuilding\n", fname);
+    close(fd);
+    free(fname);
+    return(NULL);
+  }
+
+  /* A private mapping, so nothing written through gt reaches the file */
+  base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    free(fname);
+    return(NULL);
+  }
+  if (!ids_ok (base, &hdr)) {
+    fprintf (stderr, "Genotype cache %s is damaged; rebuilding\n", fname);
+    munmap (base, (size_t)st.st_size);
+    free(fname);
+    return(NULL);
+  }
+
+  arena_add_mapping (arena, base, (size_t)st.st_size);
+
+  ids = arena_alloc(arena, sizeof(char *)*(hdr.num_indivs+1));
+  cp = base + hdr.id_offset;
+  for (i=0; i<hdr.num_indivs; i++) {
+    ids[i] = cp;
+    cp += strlen(cp) + 1;
+  }
+
+  snps = arena_alloc(arena, sizeof(snp_t)*hdr.num_snps);
+  rec = (gt_cache_snp_t *)(base + hdr.snp_offset);
+  for (s=0; s<hdr.num_snps; s++) {
+    snps[s].chr = (char)rec[s].chr;
+    snps[s].pos = rec[s].pos;
+    snps[s].rs = rec[s].rs;
+    snps[s].alleles[0] = snps[s].alleles[1] = NULL;
+    snps[s].gt = base + hdr.gt_offset + (long long)s*hdr.num_indivs;
+    snps[s].id_list = ids;
+    snps[s].num_indivs = hdr.num_indivs;
+    snps[s].num_snps = hdr.num_snps;
+    snps[s].num_groups = rec[s].num_groups;
+    for (i=0; i<4; i++) snps[s].geno_counts[i] = rec[s].geno_counts[i];
+    snps[s].dup_rep = NULL;
+    snps[s].dup_next = NULL;
+    snps[s].next = (s+1 < hdr.num_snps) ? &snps[s+1] : NULL;
+  }
+
+  fprintf (stderr, "Read %d snps x %d individuals from genotype cache %s\n", hdr.num_snps, hdr.num_indivs, fname);
+  free(fname);
+  return(snps);
+}
+
+/*
+ * Writes <prefix>.gtc for a panel just read from <prefix>.ped/.map.  The
+ * cache is written to a temporary file and renamed into place, and a
+ * failure only costs the next run a full load.
+ */
+void gt_cache_write (char *prefix, snp_t *genotypes) {
+  gt_cache_header_t hdr;
+  gt_cache_snp_t rec;
+  snp_t *cur;
+  char *fname, *tmpname;
+  char pad[GT_CACHE_ALIGN];
+  long long pos;
+  FILE *f;
+  int i, ok;
+
+  memset (&hdr, 0, sizeof(hdr));
+  if (!input_signature (prefix, &hdr)) return;
+  strcpy (hdr.magic, GT_CACHE_MAGIC);
+  hdr.version = GT_CACHE_VERSION;
+  hdr.byte_order = GT_CACHE_BYTE_ORDER;
+  hdr.num_snps = genotypes->num_snps;
+  hdr.num_indivs = genotypes->num_indivs;
+  hdr.snp_offset = sizeof(hdr);
+  hdr.id_offset = hdr.snp_offset + (long long)hdr.num_snps*sizeof(gt_cache_snp_t);
+  hdr.id_bytes = 0;
+  for (i=0; i<hdr.num_indivs; i++) hdr.id_bytes += strlen(genotypes->id_list[i]) + 1;
+  hdr.gt_offset = hdr.id_offset + hdr.id_bytes;
+  hdr.gt_offset = (hdr.gt_offset + GT_CACHE_ALIGN - 1) / GT_CACHE_ALIGN * GT_CACHE_ALIGN;
+
+  fname = MallocOrDie(strlen(prefix) + 8);
+  tmpname = MallocOrDie(strlen(prefix) + 16);
+  sprintf (fname, "%s.gtc", prefix);
+  sprintf (tmpname, "%s.gtc.%d", prefix, (int)getpid());
+  f = fopen(tmpname, "w");
+  if (f == NULL) {
+    Warn("Cannot write genotype cache %s\n", tmpname);
+    free(fname);
+    free(tmpname);
+    return;
+  }
+
+  ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1);
+  for (cur = genotypes; ok && cur != NULL; cur = cur->next) {
+    memset (&rec, 0, sizeof(rec));
+    rec.chr = cur->chr;
+    rec.pos = cur->pos;
+    rec.rs = cur->rs;
+    rec.num_groups = cur->num_groups;
+    for (i=0; i<4; i++) rec.geno_counts[i] = cur->geno_counts[i];
+    ok = (fwrite(&rec, sizeof(rec), 1, f) == 1);
+  }
+  for (i=0; ok && i<hdr.num_indivs; i++) {
+    ok = (fwrite(genotypes->id_list[i], strlen(genotypes->id_list[i]) + 1, 1, f) == 1);
+  }
+  pos = hdr.id_offset + hdr.id_bytes;
+  memset (pad, 0, sizeof(pad));
+  if (ok && hdr.gt_offset > pos) ok = (fwrite(pad, hdr.gt_offset - pos, 1, f) == 1);
+  for (cur = genotypes; ok && cur != NULL; cur = cur->next) {
+    ok = (fwrite(cur->gt, hdr.num_indivs, 1, f) == 1);
+  }
+  if (fclose(f) != 0) ok = 0;
+
+  if (!ok || rename(tmpname, fname) != 0) {
+    Warn("Cannot write genotype cache %s\n", fname);
+    unlink(tmpname);
+  } else {
+    fprintf (stderr, "Wrote genotype cache %s\n", fname);
+  }
+  free(fname);
+  free(tmpname);
+}
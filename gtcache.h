@@ -0,0 +1,22 @@
+/*
+ * gtcache.h
+ *
+ * Binary cache of a recoded .ped/.map panel, kept next to the PLINK
+ * prefix so reruns can skip parsing and recoding.
+ */
+
+#ifndef _gtcache_h
+#define _gtcache_h
+
+#include "structs.h"
+#include "arena.h"
+
+/* Bump whenever the recoding of the cached genotypes, the layout or the
+   input signature changes, so older caches are rebuilt */
+#define GT_CACHE_VERSION 3
+
+snp_t *gt_cache_load (char *prefix, arena_t *arena);
+
+void gt_cache_write (char *prefix, snp_t *genotypes);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * interact.c
+ *
+ * Genotype x covariate interaction test.  Each pair is the ordinary
+ * least squares fit of expression ~ g + c + g*c over the individuals
+ * with a genotype call, and the p-value is the t-test of the g*c
+ * coefficient on n-4 degrees of freedom.
+ *
+ * X'X depends only on the SNP and the covariate, so it is inverted once
+ * per SNP (inter_snp).  Per pair, one pass over the individuals gives
+ * X'y and y'y, and the coefficients, residual sum of squares and
+ * standard error follow from the stored inverse in O(1).  The covariate
+ * is expected centered and scaled (read_covariate does this), which
+ * keeps X'X well conditioned without changing the interaction test.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include <gsl/gsl_cdf.h>
+
+#include "interact.h"
+#include "kernel.h"
+
+/*
+ * Inverts the symmetric 4x4 matrix a in place by Gauss-Jordan with
+ * partial pivoting.  Returns 0 if a pivot is negligible next to the
+ * diagonal, i.e. the design is (nearly) singular.
+ */
+static int invert4 (double *a) {
+  double inv[16];
+  double scale = 0., t;
+  int i, j, k, piv;
+
+  for (i=0; i<16; i++) inv[i] = (i % 5 == 0) ? 1. : 0.;
+  for (i=0; i<4; i++) {
+    if (fabs(a[i*5]) > scale) scale = fabs(a[i*5]);
+  }
+  if (scale == 0.) return(0);
+
+  for (k=0; k<4; k++) {
+    piv = k;
+    for (i=k+1; i<4; i++) {
+      if (fabs(a[i*4+k]) > fabs(a[piv*4+k])) piv = i;
+    }
+    if (fabs(a[piv*4+k]) < 1e-10*scale) return(0);
+    if (piv != k) {
+      for (j=0; j<4; j++) {
+	t = a[k*4+j]; a[k*4+j] = a[piv*4+j]; a[piv*4+j] = t;
+	t = inv[k*4+j]; inv[k*4+j] = inv[piv*4+j]; inv[piv*4+j] = t;
+      }
+    }
+    t = 1./a[k*4+k];
+    for (j=0; j<4; j++) {
+      a[k*4+j] *= t;
+      inv[k*4+j] *= t;
+    }
+    for (i=0; i<4; i++) {
+      if (i == k || a[i*4+k] == 0.) continue;
+      t = a[i*4+k];
+      for (j=0; j<4; j++) {
+	a[i*4+j] -= t*a[k*4+j];
+	inv[i*4+j] -= t*inv[k*4+j];
+      }
+    }
+  }
+  for (i=0; i<16; i++) a[i] = inv[i];
+  return(1);
+}
+
+void inter_snp (inter_snp_t *s, char *gts, float *cov, int n_tot) {
+  double x[4];
+  double xtx[16];
+  int i, j, k, g;
+
+  for (i=0; i<16; i++) xtx[i] = 0.;
+  s->n = 0;
+  x[0] = 1.;
+  for (i=0; i<n_tot; i++) {
+    g = (int)(gts[i]);
+    if (g == 127) continue;
+    s->n++;
+    x[1] = g;
+    x[2] = cov[i];
+    x[3] = g*cov[i];
+    for (j=0; j<4; j++) {
+      for (k=j; k<4; k++) xtx[j*4+k] += x[j]*x[k];
+    }
+  }
+  for (j=0; j<4; j++) {
+    for (k=0; k<j; k++) xtx[j*4+k] = xtx[k*4+j];
+  }
+
+  s->ok = (s->n > 4 && invert4(xtx));
+  for (i=0; i<16; i++) s->inv[i] = s->ok ? xtx[i] : 0.;
+}
+
+/* s holds inter_snp() of gts; a singular design gives p = 1.  stats, if
+   not NULL, gets the g*c coefficient and its standard error */
+KERNEL_CLONES
+float inter_significance (char *gts, float *vals, float *cov, int n_tot, inter_snp_t *s, pair_stats_t *stats) {
+  double xty[4], beta[4];
+  double sum_y2 = 0., rss, se, t1, v, cv;
+  int i, j, g;
+
+  if (stats != NULL) stats->beta = stats->se = 0.;
+  if (!s->ok) return(1.);
+
+  xty[0] = xty[1] = xty[2] = xty[3] = 0.;
+  for (i=0; i<n_tot; i++) {
+    g = (int)(gts[i]);
+    if (g != 127) {
+      v = (double)vals[i];
+      cv = (double)cov[i]*v;
+      xty[0] += v;
+      xty[1] += g*v;
+      xty[2] += cv;
+      xty[3] += g*cv;
+      sum_y2 += v*v;
+    }
+  }
+
+  rss = sum_y2;
+  for (j=0; j<4; j++) {
+    beta[j] = s->inv[j*4]*xty[0] + s->inv[j*4+1]*xty[1] + s->inv[j*4+2]*xty[2] + s->inv[j*4+3]*xty[3];
+    rss -= beta[j]*xty[j];
+  }
+  if (rss <= 0.) return(1.);
+
+  se = sqrt(rss/(s->n-4) * s->inv[15]);
+  if (stats != NULL) {
+    stats->beta = (float)beta[3];
+    stats->se = (float)se;
+  }
+  t1 = beta[3]/se;
+  return((float)(2*gsl_cdf_tdist_Q(fabs(t1), (double)(s->n-4))));
+}
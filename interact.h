@@ -0,0 +1,25 @@
+/*
+ * interact.h
+ *
+ * Genotype x covariate interaction test: expression ~ g + c + g*c, with
+ * a t-test on the interaction term.
+ */
+
+#ifndef _interact_h
+#define _interact_h
+
+#include "structs.h"
+
+/* What the fit needs from a SNP and the covariate alone, computed once
+   per SNP and shared by every probe */
+typedef struct _inter_snp_t {
+  int n;                        /* Individuals with a genotype call */
+  int ok;                       /* 0 if the design is singular */
+  double inv[16];               /* (X'X)^-1 for X = [1 g c g*c] */
+} inter_snp_t;
+
+void inter_snp (inter_snp_t *s, char *gts, float *cov, int n_tot);
+
+float inter_significance (char *gts, float *vals, float *cov, int n_tot, inter_snp_t *s, pair_stats_t *stats);
+
+#endif
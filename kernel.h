@@ -0,0 +1,23 @@
+/*
+ * kernel.h
+ *
+ * KERNEL_CLONES marks the inner statistical kernels.  With GCC on
+ * x86-64 each is compiled for AVX2, SSE4.2 and the baseline, and the
+ * loader picks the best one the CPU supports when the program starts.
+ * Build with -DNO_KERNEL_CLONES to get a single baseline version.
+ */
+
+#ifndef _kernel_h
+#define _kernel_h
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__has_attribute) && !defined(NO_KERNEL_CLONES)
+#if __has_attribute(target_clones)
+#define KERNEL_CLONES __attribute__((target_clones("avx2","sse4.2","default")))
+#endif
+#endif
+
+#ifndef KERNEL_CLONES
+#define KERNEL_CLONES
+#endif
+
+#endif
@@ -0,0 +1,579 @@
+/*
+ * libeqtl.c
+ *
+ * The engine behind the eqtl program, callable from other code: load a
+ * panel, load datasets against it, scan each and hand the significant
+ * pairs to a callback.  Each entry point sets an error trap, so a Fail()
+ * anywhere below it frees what the call had allocated and comes back as
+ * EQTL_ERROR.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "structs.h"
+#include "libeqtl.h"
+#include "eqtlio.h"
+#include "scan.h"
+#include "results.h"
+#include "qc.h"
+#include "dedup.h"
+#include "cond.h"
+#include "gtcache.h"
+#include "prescreen.h"
+#include "gene.h"
+#include "nonparam.h"
+#include "mem.h"
+#include "arena.h"
+#include "error.h"
+
+struct _eqtl_panel_t {
+  arena_t *arena;
+  snp_t *genotypes;             /* With no gt if streaming */
+  char *prefix;
+  int streaming;
+};
+
+struct _eqtl_data_t {
+  arena_t *arena;
+  arena_t *gt_arena;            /* Holds view if it is a copy, else NULL */
+  snp_t *view;                  /* The panel, or a copy for a subset */
+  phen_t *phenotypes;
+  float *covariate;             /* Interaction test only */
+  int *keep;                    /* Only while loading */
+  char *mask;                   /* Only while loading */
+};
+
+/* Everything one scan holds, so a failure can release it */
+typedef struct _eqtl_run_t {
+  scan_ctx_t ctx;
+  gt_stream_t *stream;
+  snp_t **block;                /* Owned if the panel is in memory */
+  mem_results_t results;         /* Backs ctx.results */
+  mem_results_t stats;           /* Backs ctx.stats */
+  result_key_t *keys;
+  fdr_hist_t *hist;
+} eqtl_run_t;
+
+void eqtl_default_opts (eqtl_opts_t *opts) {
+  opts->test_type = 0;
+  opts->interaction = NULL;
+  opts->quant_norm = 0;
+  opts->cis_only = 0;
+  opts->by_gene = 0;
+  opts->maxdist = 200000;
+  opts->num_threads = 1;
+  opts->use_hist = 0;
+  opts->dedup = 0;
+  opts->prescreen = 0;
+  opts->do_qc = 0;
+  opts->qc.min_maf = 0.;
+  opts->qc.max_missing = 1.;
+  opts->qc.min_hwe_p = 0.;
+  opts->qc.removed[0] = opts->qc.removed[1] = opts->qc.removed[2] = 0;
+  opts->streaming = 0;
+  opts->block_size = 10000;
+  opts->use_cache = 0;
+  opts->keep_file = NULL;
+  opts->log = NULL;
+}
+
+/* Why the last call in this thread returned EQTL_ERROR */
+char *eqtl_error (void) {
+  return(error_message());
+}
+
+static void eqtl_log (FILE *log, char *format, ...) {
+  va_list ap;
+
+  if (log == NULL) return;
+  va_start (ap, format);
+  vfprintf (log, format, ap);
+  va_end (ap);
+}
+
+/* Applies QC filters to the whole in-memory panel once, before it is
+   shared by the datasets; failed SNPs lose their gt */
+static void qc_genotypes (snp_t *genotypes, qc_opts_t *qc) {
+  snp_t **all;
+  snp_t *cur_snp;
+  int k, left;
+
+  all = MallocOrDie(sizeof(snp_t *)*(genotypes->num_snps+1));
+  for (cur_snp=genotypes, k=0; cur_snp != NULL; cur_snp = cur_snp->next, k++) {
+    all[k] = cur_snp;
+  }
+  left = qc_filter_block (qc, all, k);
+  free(all);
+  if (left == 0) Fail("No snps left to test\n");
+}
+
+/* Applies QC filters and deduplication to a block of SNPs, returning the
+   number left.  Groups from an earlier scan with --dedup are cleared
+   otherwise */
+static int prepare_block (snp_t **block, int num_snps, qc_opts_t *qc, int dedup, long long *num_unique_r) {
+  int k;
+
+  if (qc != NULL) num_snps = qc_filter_block (qc, block, num_snps);
+  if (dedup) {
+    *num_unique_r += dedup_genotypes (block, num_snps);
+  } else {
+    for (k=0; k<num_snps; k++) {
+      block[k]->dup_rep = NULL;
+      block[k]->dup_next = NULL;
+    }
+  }
+  return(num_snps);
+}
+
+int eqtl_load_panel (char *prefix, eqtl_opts_t *opts, eqtl_panel_t **panel_r) {
+  eqtl_panel_t *panel;
+  error_trap_t trap;
+
+  panel = MallocOrDie(sizeof(eqtl_panel_t));
+  panel->arena = arena_new(MEM_GENOTYPES);
+  panel->genotypes = NULL;
+  panel->prefix = sre_strdup(prefix, -1);
+  panel->streaming = opts->streaming;
+  *panel_r = NULL;
+
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    eqtl_free_panel (panel);
+    return(EQTL_ERROR);
+  }
+
+  if (panel->streaming) {
+    panel->genotypes = read_bed_metadata (prefix, panel->arena);
+  } else {
+    panel->genotypes = opts->use_cache ? gt_cache_load (prefix, panel->arena) : NULL;
+    if (panel->genotypes == NULL) {
+      panel->genotypes = read_genotypes (prefix, opts->num_threads, panel->arena);
+      if (opts->use_cache) gt_cache_write (prefix, panel->genotypes);
+    }
+    if (opts->do_qc) {
+      qc_genotypes (panel->genotypes, &opts->qc);
+      if (opts->log != NULL) qc_print_summary (opts->log, &opts->qc);
+    }
+  }
+
+  error_pop (&trap);
+  *panel_r = panel;
+  return(EQTL_OK);
+}
+
+void eqtl_free_panel (eqtl_panel_t *panel) {
+  if (panel == NULL) return;
+  arena_free (panel->arena);
+  free(panel->prefix);
+  free(panel);
+}
+
+/* Individuals differ between datasets, so each gets its own map into the
+   panel */
+int eqtl_load_data (eqtl_panel_t *panel, char *gene_list, char *exp_dir, eqtl_opts_t *opts, eqtl_data_t **data_r) {
+  eqtl_data_t *data;
+  error_trap_t trap;
+  snp_t *genotypes = panel->genotypes;
+  int num_kept, num_listed;
+
+  data = MallocOrDie(sizeof(eqtl_data_t));
+  data->arena = arena_new(MEM_PHENOTYPES);
+  data->gt_arena = NULL;
+  data->view = genotypes;
+  data->phenotypes = NULL;
+  data->covariate = NULL;
+  data->keep = NULL;
+  data->mask = NULL;
+  *data_r = NULL;
+
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    eqtl_free_data (data);
+    return(EQTL_ERROR);
+  }
+
+  if (opts->keep_file != NULL) {
+    data->mask = read_keep_list (opts->keep_file, genotypes->num_indivs, genotypes->id_list, &num_listed);
+    eqtl_log (opts->log, "%s lists %d of %d genotyped individuals\n", opts->keep_file, num_listed, genotypes->num_indivs);
+  }
+  data->keep = dataset_individuals (gene_list, exp_dir, genotypes->num_indivs, genotypes->id_list, data->mask, &num_kept);
+  if (num_kept < genotypes->num_indivs) {
+    if (panel->streaming) Fail("%s has %d of %d individuals; subsets cannot be used with --stream\n", exp_dir, num_kept, genotypes->num_indivs);
+    data->gt_arena = arena_new(MEM_GENOTYPES);
+    data->view = gather_genotypes (genotypes, data->keep, num_kept, data->gt_arena);
+    eqtl_log (opts->log, "Using %d of %d genotyped individuals\n", num_kept, genotypes->num_indivs);
+  }
+  free(data->keep);
+  data->keep = NULL;
+  if (data->mask != NULL) free(data->mask);
+  data->mask = NULL;
+
+  data->phenotypes = read_phenotypes (gene_list, exp_dir, data->view->num_indivs, data->view->id_list, opts->quant_norm, data->arena);
+  if (opts->test_type == 2) {
+    if (opts->interaction == NULL) Fail("The interaction test needs a covariate file\n");
+    data->covariate = read_covariate (opts->interaction, data->view->num_indivs, data->view->id_list, data->arena);
+  }
+
+  error_pop (&trap);
+  *data_r = data;
+  return(EQTL_OK);
+}
+
+void eqtl_free_data (eqtl_data_t *data) {
+  if (data == NULL) return;
+  arena_free (data->arena);
+  arena_free (data->gt_arena);
+  if (data->keep != NULL) free(data->keep);
+  if (data->mask != NULL) free(data->mask);
+  free(data);
+}
+
+static void run_free (eqtl_run_t *run) {
+  if (run->stream != NULL) {
+    gt_stream_close (run->stream);
+  } else if (run->block != NULL) {
+    free(run->block);
+  }
+  if (run->ctx.prescreen != NULL) prescreen_free (run->ctx.prescreen, run->ctx.num_phens);
+  if (run->ctx.phens != NULL) free(run->ctx.phens);
+  gene_free (run->ctx.genes, run->ctx.num_genes);
+  mem_free (run->ctx.orders);
+  mem_free_results (&run->results);
+  mem_free_results (&run->stats);
+  mem_free (run->keys);
+  if (run->hist != NULL) free(run->hist);
+  pthread_mutex_destroy (&run->ctx.lock);
+  free(run);
+}
+
+/* If run->stream is NULL, genotypes are all in memory and the panel is
+   scanned as a single block, skipping SNPs that QC has removed; otherwise
+   genotypes holds only the SNP metadata and blocks are read from the
+   stream and released as the scan goes */
+static void get_results (eqtl_run_t *run, snp_t *genotypes, phen_t *phenotypes, float *covariate, eqtl_opts_t *opts) {
+  scan_ctx_t *ctx = &run->ctx;
+  qc_opts_t *qc = NULL;
+  int phen_count = 0;
+
+  phen_t *cur_phen;
+  snp_t *cur_snp;
+  int num_snps, block_snps, num_blocks = 0;
+  long long num_unique = 0;
+  int k;
+  long long i;
+
+  num_snps = genotypes->num_snps;
+  if (run->stream == NULL) {
+    /* The whole panel is one block */
+    run->block = MallocOrDie(sizeof(snp_t *)*(num_snps+1));
+    for (cur_snp=genotypes, k=0; cur_snp != NULL; cur_snp = cur_snp->next) {
+      if (cur_snp->gt != NULL) run->block[k++] = cur_snp;
+    }
+    num_snps = prepare_block (run->block, k, NULL, opts->dedup, &num_unique);
+    if (opts->dedup) eqtl_log (opts->log, "There are %lld distinct genotype vectors among %d snps\n", num_unique, num_snps);
+    if (num_snps == 0) Fail("No snps left to test\n");
+  } else if (opts->do_qc) {
+    /* Streamed blocks are filtered as they are read */
+    qc = &opts->qc;
+    qc->removed[0] = qc->removed[1] = qc->removed[2] = 0;
+  }
+
+  /* Count phenotypes and let us know how many tests */
+  for (cur_phen=phenotypes; cur_phen != NULL; cur_phen = cur_phen->next) {
+    phen_count++;
+  }
+  eqtl_log (opts->log, "There are %d snps in %d phenotypes tested in %d individuals\n", num_snps, phen_count, genotypes->num_indivs);
+
+  /* Prepare for analysis */
+  ctx->phens = MallocOrDie(sizeof(phen_t *)*(phen_count+1));
+  for (cur_phen=phenotypes, k=0; cur_phen != NULL; cur_phen = cur_phen->next, k++) {
+    ctx->phens[k] = cur_phen;
+  }
+  ctx->num_phens = phen_count;
+  ctx->num_indivs = genotypes->num_indivs;
+  ctx->test_type = opts->test_type;
+  ctx->covariate = covariate;
+  ctx->cis_only = opts->cis_only;
+  ctx->maxdist = opts->maxdist;
+  ctx->num_threads = opts->num_threads;
+  scan_choose_tiles (ctx);
+  if (opts->test_type == 0) {
+    /* Sorted once per probe; each test only skips its missing calls */
+    ctx->orders = mem_alloc(MEM_SCRATCH, sizeof(int)*(size_t)phen_count*ctx->num_indivs);
+    for (k=0; k<phen_count; k++) {
+      nonparam_order (ctx->phens[k]->values, ctx->num_indivs, ctx->orders + (size_t)k*ctx->num_indivs);
+    }
+  }
+  if (opts->by_gene) {
+    if (!opts->cis_only) Fail("Gene-level scans are cis only\n");
+    ctx->genes = gene_groups (ctx->phens, phen_count, &ctx->num_genes);
+    eqtl_log (opts->log, "Probes fall in %d genes\n", ctx->num_genes);
+  }
+  if (!opts->cis_only) {
+    fprintf (stderr, "Scanning in tiles of %d snps x %d phenotypes\n", ctx->tile_snps, ctx->tile_phens);
+    if (opts->prescreen && opts->test_type == 2) Fail("There is no prescreen for the interaction test\n");
+    if (opts->prescreen) ctx->prescreen = prescreen_new (ctx->phens, phen_count, ctx->num_indivs, opts->test_type);
+  }
+  if (opts->use_hist) ctx->hist = run->hist = fdr_hist_new();
+
+  while (1) {
+    if (run->stream != NULL) {
+      block_snps = gt_stream_next (run->stream, &run->block);
+      if (block_snps == 0) break;
+      block_snps = prepare_block (run->block, block_snps, qc, opts->dedup, &num_unique);
+    } else {
+      if (num_blocks > 0) break;
+      block_snps = num_snps;
+    }
+    fprintf (stderr, "Doing block %d (%d snps)\n", num_blocks, block_snps);
+    num_blocks++;
+
+    /* Room for this block's results on top of those so far, so a
+       streamed panel holds what it has found rather than a reserve
+       for every block at once */
+    ctx->estimated_results = ctx->tot_results + 4*((long long)(MAXP * block_snps * phen_count));
+    ctx->results = mem_grow_results(&run->results, sizeof(result_t)*ctx->estimated_results);
+    ctx->stats = mem_grow_results(&run->stats, sizeof(pair_stats_t)*ctx->estimated_results);
+    if (ctx->results == NULL || ctx->stats == NULL) {
+      Fail("Tried to allocate %lld results of %ld bytes and failed\n", ctx->estimated_results, sizeof(result_t) + sizeof(pair_stats_t));
+    }
+
+    scan_block (ctx, run->block, block_snps);
+  }
+
+  if (run->stream != NULL) {
+    if (qc != NULL && opts->log != NULL) qc_print_summary (opts->log, qc);
+    if (opts->dedup) eqtl_log (opts->log, "There are %lld distinct genotype vectors in %d blocks\n", num_unique, num_blocks);
+  }
+  if (ctx->prescreen != NULL) {
+    fprintf (stderr, "Prescreen ruled out %lld of %lld tests\n", ctx->screened_out, ctx->total_tests);
+  }
+
+  /* Now, sort the results in anticipation of B-H FDR.  Sort packed
+     (p, index) keys rather than chasing pointers to each result.  With
+     a histogram the FDR cutoff is found without sorting at all */
+  if (!opts->use_hist) {
+    run->keys = mem_alloc(MEM_RESULTS, sizeof(result_key_t)*(ctx->tot_results+1));
+    for (i=0; i<ctx->tot_results; i++) {
+      run->keys[i].p = ctx->results[i].p;
+      run->keys[i].index = i;
+    }
+    sort_result_keys (run->keys, ctx->tot_results);
+  }
+}
+
+/* Marks why result r is significant and hands it to func if it is;
+   returns what func does */
+static int emit_result (eqtl_run_t *run, long long r, int is_fdr, int is_cis_fdr, int cis_only, eqtl_hit_func func, void *arg) {
+  result_t *res = &run->ctx.results[r];
+  double total_tests_d = (double)run->ctx.total_tests;
+  double total_cis_tests_d = (double)run->ctx.total_cis_tests;
+  eqtl_hit_t hit;
+
+  /* Bitwise marking of why sig:
+     1 = Trans Bonferonni
+     2 = Trans FDR
+     4 = P<1e-05
+     8 = Cis Bonferonni
+     16 = Cis FDR */
+  hit.sig = 0;
+  if (cis_only == 0) {
+    if (res->p < ALPHA/ total_tests_d) hit.sig++;
+    if (is_fdr) hit.sig += 2;
+    if (res->p < THRESHOLD) hit.sig += 4;
+  }
+  if (res->good_for_cis == 1) {
+    if (res->p < ALPHA/total_cis_tests_d) hit.sig += 8;
+    if (is_cis_fdr) hit.sig += 16;
+  }
+  if (hit.sig == 0) return(0);
+  hit.snp = res->snp;
+  hit.phen = res->phen;
+  hit.p = res->p;
+  hit.flag = res->flag;
+  hit.test_type = run->ctx.test_type;
+  hit.stats = run->ctx.stats[r];
+  return((*func)(&hit, arg));
+}
+
+/* Hands each significant result to func, marking why it is significant.
+   If run->keys is NULL, results are unsorted and run->hist, filled during
+   the scan, gives the FDR cutoffs: results it cannot decide are held
+   back until the rest have gone out in scan order and their p-values
+   have settled the cutoffs */
+static void emit_hits (eqtl_run_t *run, int cis_only, eqtl_hit_func func, void *arg) {
+  result_t *results = run->ctx.results;
+  result_key_t *keys = run->keys;
+  long long tot_results = run->ctx.tot_results;
+  double total_tests_d = (double)run->ctx.total_tests;
+  double total_cis_tests_d = (double)run->ctx.total_cis_tests;
+
+  long long fdr_threshold_index = -1;
+  long long cis_fdr_threshold_index = -1;
+  long long k_for_cis_fdr = 0;
+
+  fdr_band_t band, cis_band;
+  double *vals = NULL, *cis_vals = NULL;
+  long long *held = NULL;
+  long long num_vals = 0, num_cis_vals = 0, num_held = 0;
+  int in_band, in_cis_band;
+  int is_fdr, is_cis_fdr;
+  int stop = 0;
+
+  long long i, r;
+  result_t *res;
+
+  if (keys == NULL) {
+    fdr_hist_band (run->hist, total_tests_d, 0, &band);
+    fdr_hist_band (run->hist, total_cis_tests_d, 1, &cis_band);
+    vals = MallocOrDie(sizeof(double)*(band.count+1));
+    cis_vals = MallocOrDie(sizeof(double)*(cis_band.count+1));
+    held = MallocOrDie(sizeof(long long)*(band.count+cis_band.count+1));
+  }
+
+  /* Now, do B-H to find FDR threshold, both cis and trans */
+  for (i=0; keys != NULL && i < tot_results; i++) {
+    if (keys[i].p <= ((double)(i+1.))/total_tests_d * FDR_ALPHA) {
+      fdr_threshold_index = i;
+    }
+    if (results[keys[i].index].good_for_cis == 1) {
+      k_for_cis_fdr++;
+      if (keys[i].p <= ((double)(k_for_cis_fdr))/total_cis_tests_d * FDR_ALPHA) {
+	cis_fdr_threshold_index = i;
+      }
+    }
+  }
+
+  for (i = 0; i < tot_results && !stop; i++) {
+    r = (keys != NULL) ? keys[i].index : i;
+    res = &results[r];
+    if (keys != NULL) {
+      is_fdr = (i <= fdr_threshold_index);
+      is_cis_fdr = (i <= cis_fdr_threshold_index);
+    } else {
+      in_band = fdr_band_has (&band, res->p);
+      in_cis_band = (res->good_for_cis == 1 && fdr_band_has (&cis_band, res->p));
+      if (in_band) vals[num_vals++] = res->p;
+      if (in_cis_band) cis_vals[num_cis_vals++] = res->p;
+      if (in_band || in_cis_band) {
+	held[num_held++] = r;
+	continue;
+      }
+      is_fdr = (band.has_cutoff && res->p <= band.cutoff);
+      is_cis_fdr = (cis_band.has_cutoff && res->p <= cis_band.cutoff);
+    }
+    stop = emit_result (run, r, is_fdr, is_cis_fdr, cis_only, func, arg);
+  }
+
+  if (keys == NULL) {
+    fdr_band_resolve (&band, vals, num_vals, total_tests_d);
+    fdr_band_resolve (&cis_band, cis_vals, num_cis_vals, total_cis_tests_d);
+    for (i = 0; i < num_held && !stop; i++) {
+      res = &results[held[i]];
+      is_fdr = (band.has_cutoff && res->p <= band.cutoff);
+      is_cis_fdr = (cis_band.has_cutoff && res->p <= cis_band.cutoff);
+      stop = emit_result (run, held[i], is_fdr, is_cis_fdr, cis_only, func, arg);
+    }
+    free(vals);
+    free(cis_vals);
+    free(held);
+  }
+}
+
+static int gene_hit_sort_func (const void *a, const void *b) {
+  eqtl_gene_hit_t *i, *j;
+
+  i = (eqtl_gene_hit_t *)a;
+  j = (eqtl_gene_hit_t *)b;
+  if (i->p != j->p) return(i->p < j->p ? -1 : 1);
+  return(strcmp(i->gene, j->gene));
+}
+
+/* The genes that had cis SNPs, best first, with Bonferroni and B-H FDR
+   across them */
+static eqtl_gene_hit_t *gene_hits (scan_ctx_t *ctx, int *num_r) {
+  eqtl_gene_hit_t *hits;
+  gene_t *gene;
+  int n = 0, fdr_index = -1;
+  int g;
+
+  hits = MallocOrDie(sizeof(eqtl_gene_hit_t)*(ctx->num_genes+1));
+  for (g=0; g<ctx->num_genes; g++) {
+    gene = &ctx->genes[g];
+    if (gene->num_tests == 0) continue;
+    hits[n].gene = gene->name;
+    hits[n].num_probes = gene->num_probes;
+    hits[n].num_tests = gene->num_tests;
+    hits[n].snp = gene->best_snp;
+    hits[n].phen = gene->best_phen;
+    hits[n].min_p = gene->min_p;
+    hits[n].p = gene_p(gene);
+    n++;
+  }
+  qsort (hits, n, sizeof(eqtl_gene_hit_t), &gene_hit_sort_func);
+  for (g=0; g<n; g++) {
+    if (hits[g].p <= ((double)(g+1.))/n * FDR_ALPHA) fdr_index = g;
+  }
+  for (g=0; g<n; g++) {
+    hits[g].sig = 0;
+    if (hits[g].p < ALPHA/n) hits[g].sig += 1;
+    if (g <= fdr_index) hits[g].sig += 2;
+  }
+  *num_r = n;
+  return(hits);
+}
+
+int eqtl_scan (eqtl_panel_t *panel, eqtl_data_t *data, eqtl_opts_t *opts, eqtl_hit_func func, void *arg, eqtl_summary_t *summary) {
+  eqtl_run_t *run;
+  error_trap_t trap;
+
+  run = MallocOrDie(sizeof(eqtl_run_t));
+  memset (run, 0, sizeof(eqtl_run_t));
+  pthread_mutex_init (&run->ctx.lock, NULL);
+
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    run_free (run);
+    return(EQTL_ERROR);
+  }
+
+  if (panel->streaming) run->stream = gt_stream_open (panel->prefix, data->view, opts->block_size, opts->num_threads);
+  get_results (run, data->view, data->phenotypes, data->covariate, opts);
+  eqtl_log (opts->log, "There are %lld total tests and %lld total cis tests\n", run->ctx.total_tests, run->ctx.total_cis_tests);
+  if (summary != NULL) {
+    summary->total_tests = run->ctx.total_tests;
+    summary->total_cis_tests = run->ctx.total_cis_tests;
+    summary->num_results = run->ctx.tot_results;
+    summary->genes = NULL;
+    summary->num_genes = 0;
+    if (run->ctx.genes != NULL) summary->genes = gene_hits (&run->ctx, &summary->num_genes);
+  }
+  emit_hits (run, opts->cis_only, func, arg);
+
+  error_pop (&trap);
+  run_free (run);
+  return(EQTL_OK);
+}
+
+/* Independent cis signals per probe; free *hits_r with free() */
+int eqtl_conditional (eqtl_panel_t *panel, eqtl_data_t *data, eqtl_opts_t *opts, double threshold, cond_hit_t **hits_r, long long *num_hits_r) {
+  error_trap_t trap;
+
+  *hits_r = NULL;
+  *num_hits_r = 0;
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) return(EQTL_ERROR);
+  if (panel->streaming) Fail("Conditional scans need genotypes in memory; they cannot be used with --stream\n");
+  if (opts->test_type == 2) Fail("Conditional scans support the K-W and regression tests only\n");
+  *hits_r = cond_cis_scan (data->view, data->phenotypes, opts->test_type, opts->maxdist, threshold, opts->num_threads, num_hits_r);
+  error_pop (&trap);
+  return(EQTL_OK);
+}
@@ -0,0 +1,102 @@
+/*
+ * libeqtl.h
+ *
+ * Library interface to the eQTL engine.  A panel of genotypes is loaded
+ * once, any number of expression datasets are loaded against it, and
+ * each scan hands its significant SNP-probe pairs to a callback.  Calls
+ * return EQTL_OK or EQTL_ERROR, with the reason from eqtl_error();
+ * errors in input data do not exit the process, and a failed call frees
+ * what it loaded (a few bytes of file names may leak).  Running out of
+ * memory and failing to start threads still exit.
+ */
+
+#ifndef _libeqtl_h
+#define _libeqtl_h
+
+#include <stdio.h>
+
+#include "structs.h"
+#include "qc.h"
+#include "cond.h"
+
+#define EQTL_OK 0
+#define EQTL_ERROR 1
+
+typedef struct _eqtl_opts_t {
+  int test_type;                /* 0 = K-W, 1 = linear regression, 2 = interaction */
+  char *interaction;            /* Covariate file for the interaction test */
+  int quant_norm;               /* Quantile normalize expression */
+  int cis_only;
+  int by_gene;                  /* Cis: group probes by the gene list's gene column */
+  int maxdist;                  /* Bases either side of a probe for cis */
+  int num_threads;
+  int use_hist;                 /* Sort-free FDR from a histogram */
+  int dedup;                    /* Test identical gt vectors once */
+  int prescreen;                /* Cheap bound before exact trans tests */
+  int do_qc;
+  qc_opts_t qc;
+  int streaming;                /* Read genotypes in blocks from .bed */
+  int block_size;
+  int use_cache;                /* Binary genotype cache next to the prefix */
+  char *keep_file;              /* Analyze only the individuals listed, or NULL */
+  FILE *log;                    /* Summary lines as the CLI prints them, or NULL */
+} eqtl_opts_t;
+
+/* A significant pair; sig has the bits of the CLI's last column:
+   1 trans Bonferroni, 2 trans FDR, 4 p < THRESHOLD, 8 cis Bonferroni,
+   16 cis FDR */
+typedef struct _eqtl_hit_t {
+  snp_t *snp;
+  phen_t *phen;
+  double p;
+  int flag;
+  int sig;
+  int test_type;                /* As in eqtl_opts_t; says which stats apply */
+  pair_stats_t stats;           /* Effect summary for the test type */
+} eqtl_hit_t;
+
+/* Returns 0 to go on, anything else to stop the scan early */
+typedef int (*eqtl_hit_func) (eqtl_hit_t *hit, void *arg);
+
+/* A gene's best cis pair with by_gene; p is min_p Sidak corrected for
+   the gene's num_tests SNP-probe tests, and sig has 1 for Bonferroni and
+   2 for FDR across the genes tested */
+typedef struct _eqtl_gene_hit_t {
+  char *gene;
+  int num_probes;
+  long long num_tests;
+  snp_t *snp;
+  phen_t *phen;
+  double min_p;
+  double p;
+  int sig;
+} eqtl_gene_hit_t;
+
+typedef struct _eqtl_summary_t {
+  long long total_tests;
+  long long total_cis_tests;
+  long long num_results;        /* Pairs with p <= MAXP */
+  eqtl_gene_hit_t *genes;       /* With by_gene, genes tested, best first; */
+  int num_genes;                /*   free with free(), else NULL */
+} eqtl_summary_t;
+
+typedef struct _eqtl_panel_t eqtl_panel_t;
+typedef struct _eqtl_data_t eqtl_data_t;
+
+void eqtl_default_opts (eqtl_opts_t *opts);
+
+char *eqtl_error (void);
+
+int eqtl_load_panel (char *prefix, eqtl_opts_t *opts, eqtl_panel_t **panel_r);
+
+int eqtl_load_data (eqtl_panel_t *panel, char *gene_list, char *exp_dir, eqtl_opts_t *opts, eqtl_data_t **data_r);
+
+int eqtl_scan (eqtl_panel_t *panel, eqtl_data_t *data, eqtl_opts_t *opts, eqtl_hit_func func, void *arg, eqtl_summary_t *summary);
+
+int eqtl_conditional (eqtl_panel_t *panel, eqtl_data_t *data, eqtl_opts_t *opts, double threshold, cond_hit_t **hits_r, long long *num_hits_r);
+
+void eqtl_free_data (eqtl_data_t *data);
+
+void eqtl_free_panel (eqtl_panel_t *panel);
+
+#endif
@@ -0,0 +1,419 @@
+/*
+ * mem.c
+ *
+ * Memory budget.  Before anything is loaded, mem_plan works out the
+ * footprint of a run from the number of SNPs, individuals and probes:
+ * genotypes, expression, stored results and FDR keys, and per-thread
+ * scratch.  If that is over --mem-limit it gives up, in order, the sort
+ * keys (FDR from a histogram), resident results (kept in a file-backed
+ * mapping instead), the in-memory panel (streaming blocks, smaller until
+ * they fit) and threads, and refuses the run if none of that is enough.
+ *
+ * The large allocations go through mem_alloc, which keeps a running
+ * total per category, so actual use is tracked against the same
+ * accounting and a run that outgrows the limit stops with a report rather
+ * than being killed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "structs.h"
+#include "mem.h"
+#include "results.h"
+#include "scan.h"
+#include "prescreen.h"
+#include "interact.h"
+#include "arena.h"
+#include "error.h"
+
+#define COND_WINDOW 1024        /* SNPs per cis window assumed for --cond */
+
+static char *category_names[MEM_CATEGORIES] = { "genotypes", "expression", "results", "scratch" };
+
+typedef struct _mem_header_t {
+  long long size;
+  long long category;
+} mem_header_t;
+
+static long long mem_limit = 0;
+static long long mem_planned = 0;
+static long long mem_used[MEM_CATEGORIES];
+static long long mem_peak[MEM_CATEGORIES];
+static long long mem_total = 0;
+static long long mem_peak_total = 0;
+static int spill_results = 0;
+
+static char *format_size (double bytes, char *buf) {
+  char *units = "BKMGT";
+  int u = 0;
+
+  while (bytes >= 1024. && u < 4) {
+    bytes /= 1024.;
+    u++;
+  }
+  if (u == 0) sprintf (buf, "%.0f%c", bytes, units[u]);
+  else sprintf (buf, "%.1f%c", bytes, units[u]);
+  return(buf);
+}
+
+/* Sizes like 512M, 8G or 1.5T (powers of 1024), or plain bytes */
+long long mem_parse_size (char *s) {
+  char *ep;
+  double v;
+
+  v = strtod(s, &ep);
+  switch (toupper(*ep)) {
+  case 'T': v *= 1024.;
+    /* fall through */
+  case 'G': v *= 1024.;
+    /* fall through */
+  case 'M': v *= 1024.;
+    /* fall through */
+  case 'K': v *= 1024.;
+    ep++;
+    break;
+  case '\0': break;
+  default: Fail("Bad size %s\n", s);
+  }
+  /* Nothing may follow the unit: "512MB" or "1Gx" is a typo, not 512M */
+  if (*ep != '\0' || !(v > 0.)) Fail("Bad size %s\n", s);
+  return((long long)v);
+}
+
+static long long count_lines (char *filename) {
+  char buf[65536];
+  long long n = 0;
+  size_t len, i;
+  FILE *f;
+
+  f = fopen(filename, "r");
+  if (f == NULL) return(-1);
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+    for (i=0; i<len; i++) {
+      if (buf[i] == '\n') n++;
+    }
+  }
+  fclose(f);
+  return(n);
+}
+
+static long long file_size (char *filename) {
+  struct stat st;
+
+  if (stat(filename, &st) != 0) return(-1);
+  return((long long)st.st_size);
+}
+
+/* Counts SNPs, individuals and probes from the input files without
+   loading them.  For a .ped the individuals are bounded from the file
+   size the same way the loader sizes its matrix. */
+void mem_shape_from_files (mem_shape_t *shape, char *prefix, dataset_t *datasets, int num_datasets) {
+  char *fname;
+  long long n, ped_size;
+  int d;
+
+  fname = MallocOrDie(strlen(prefix) + 8);
+  sprintf (fname, "%s.bed", prefix);
+  shape->can_stream = (file_size(fname) >= 0);
+  sprintf (fname, "%s.map", prefix);
+  shape->num_snps = count_lines(fname);
+  sprintf (fname, "%s.ped", prefix);
+  ped_size = file_size(fname);
+  if (shape->num_snps >= 0 && ped_size >= 0) {
+    shape->num_indivs = ped_size / (4*shape->num_snps + 12) + 1;
+  } else {
+    sprintf (fname, "%s.bim", prefix);
+    shape->num_snps = count_lines(fname);
+    sprintf (fname, "%s.fam", prefix);
+    shape->num_indivs = count_lines(fname);
+  }
+  if (shape->num_snps < 0 || shape->num_indivs < 0) Fail("Cannot size the genotypes of %s\n", prefix);
+  free(fname);
+
+  shape->num_datasets = num_datasets;
+  shape->num_phens = 0;
+  for (d=0; d<num_datasets; d++) {
+    n = count_lines(datasets[d].gene_list);
+    if (n < 0) Fail("Cannot open %s\n", datasets[d].gene_list);
+    if (n > shape->num_phens) shape->num_phens = n;
+  }
+}
+
+static void mem_footprint (mem_plan_t *plan, mem_shape_t *shape) {
+  double S = shape->num_snps;
+  double N = shape->num_indivs;
+  double P = shape->num_phens;
+  double T = plan->num_threads;
+  double block, est, table;
+
+  block = (plan->streaming && plan->block_size < S) ? plan->block_size : S;
+  /* get_results reserves 4*MAXP tests' worth per block on top of what
+     earlier blocks found, about MAXP of the tests under the null */
+  est = plan->streaming ? MAXP*(S + 4.*block)*P : 4.*MAXP*S*P;
+
+  /* Panel and dataset each have an arena with a chunk of small objects */
+  plan->need[MEM_GENOTYPES] = (long long)(S*sizeof(snp_t) + N*32. + ARENA_CHUNK_SIZE);
+  if (plan->streaming) {
+    plan->need[MEM_GENOTYPES] += (long long)(block*N + 2.*block*((N+3.)/4.));
+  } else {
+    plan->need[MEM_GENOTYPES] += (long long)(S*N);
+    /* A dataset with fewer individuals gets its own copy */
+    if (shape->num_datasets > 1) plan->need[MEM_GENOTYPES] += (long long)(S*N);
+  }
+
+  plan->need[MEM_PHENOTYPES] = (long long)(P*(N*sizeof(float) + sizeof(phen_t) + 32.) + ARENA_CHUNK_SIZE);
+
+  plan->need[MEM_RESULTS] = plan->spill ? 0 : (long long)(est*(sizeof(result_t) + sizeof(pair_stats_t)));
+  if (plan->use_hist) {
+    plan->need[MEM_RESULTS] += sizeof(fdr_hist_t);
+  } else {
+    plan->need[MEM_RESULTS] += (long long)(2.*est*sizeof(result_key_t));
+  }
+
+  plan->need[MEM_SCRATCH] = (long long)(T*(RESULT_BUF_SIZE*(sizeof(result_t) + sizeof(pair_stats_t)) + N*sizeof(int))
+					+ block*sizeof(snp_t *));
+  if (shape->test_type == 0) {
+    plan->need[MEM_SCRATCH] += (long long)(P*N*sizeof(int));
+  }
+  if (shape->cis_only) {
+    plan->need[MEM_SCRATCH] += (long long)(T*block*(2*sizeof(int) + sizeof(float) + sizeof(pair_stats_t)));
+  }
+  if (shape->test_type == 2) {
+    plan->need[MEM_SCRATCH] += (long long)(block*sizeof(inter_snp_t));
+  }
+  if (shape->dedup) {
+    for (table = 1.; table < 2.*block; table *= 2.);
+    plan->need[MEM_SCRATCH] += (long long)(table*(2*sizeof(snp_t *) + sizeof(unsigned long long)));
+  }
+  if (shape->prescreen && !shape->cis_only) {
+    plan->need[MEM_SCRATCH] += (long long)(P*(N*sizeof(float) + sizeof(double)) + block*sizeof(prescreen_snp_t));
+  }
+  if (shape->conditional) {
+    plan->need[MEM_SCRATCH] += (long long)(T*(COND_WINDOW*N*sizeof(double) + N*(sizeof(double) + 3*sizeof(float)))
+					   + S*sizeof(snp_t *));
+  }
+}
+
+static long long mem_need (mem_plan_t *plan) {
+  long long total = 0;
+  int c;
+
+  for (c=0; c<MEM_CATEGORIES; c++) total += plan->need[c];
+  return(total);
+}
+
+static int mem_fits (mem_plan_t *plan, mem_shape_t *shape) {
+  mem_footprint (plan, shape);
+  return(plan->limit <= 0 || mem_need(plan) <= plan->limit);
+}
+
+/*
+ * Fills in plan->need for the options in plan, relaxing them until the
+ * run fits plan->limit.  Returns 1 if it fits, 0 if nothing does.
+ */
+int mem_plan (mem_plan_t *plan, mem_shape_t *shape) {
+  mem_plan_t prev;
+  int block;
+
+  if (mem_fits (plan, shape)) return(1);
+
+  /* The histogram is a fixed size, so for small runs it costs more than
+     the keys it replaces */
+  if (!plan->use_hist) {
+    prev = *plan;
+    plan->use_hist = 1;
+    if (mem_fits (plan, shape)) return(1);
+    if (mem_need(plan) >= mem_need(&prev)) *plan = prev;
+  }
+
+  if (!plan->spill) {
+    plan->spill = 1;
+    if (mem_fits (plan, shape)) return(1);
+  }
+
+  /* Streaming needs a .bed and a single dataset covering the panel */
+  if (shape->can_stream && shape->num_datasets == 1 && !shape->conditional) {
+    block = plan->streaming ? plan->block_size : 10000;
+    plan->streaming = 1;
+    for (plan->block_size = block; plan->block_size > 64; plan->block_size /= 2) {
+      if (mem_fits (plan, shape)) return(1);
+    }
+    if (mem_fits (plan, shape)) return(1);
+  }
+
+  while (plan->num_threads > 1) {
+    plan->num_threads--;
+    if (mem_fits (plan, shape)) return(1);
+  }
+  return(0);
+}
+
+void mem_print_plan (FILE *f, mem_plan_t *plan, mem_shape_t *shape) {
+  char b1[32], b2[32];
+  int c;
+
+  fprintf (f, "Memory plan for %lld snps x %lld individuals x %lld probes, limit %s:\n",
+	   shape->num_snps, shape->num_indivs, shape->num_phens, format_size((double)plan->limit, b1));
+  for (c=0; c<MEM_CATEGORIES; c++) {
+    fprintf (f, "  %-12s %10s\n", category_names[c], format_size((double)plan->need[c], b1));
+  }
+  fprintf (f, "  %-12s %10s\n", "total", format_size((double)mem_need(plan), b2));
+  fprintf (f, "  genotypes %s", plan->streaming ? "streamed" : "in memory");
+  if (plan->streaming) fprintf (f, " in blocks of %d snps", plan->block_size);
+  fprintf (f, ", FDR from %s, results %s, threads %d\n",
+	   plan->use_hist ? "a histogram" : "a sort",
+	   plan->spill ? "spilled to disk" : "in memory", plan->num_threads);
+}
+
+/* Makes mem_alloc hold usage to the plan's limit */
+void mem_enforce (mem_plan_t *plan) {
+  mem_limit = plan->limit;
+  mem_planned = mem_need(plan);
+  spill_results = plan->spill;
+}
+
+/* Adds bytes to the running totals and the peaks; returns 1 if that
+   puts the total over the limit */
+static int mem_add (int category, long long bytes) {
+  long long total, peak;
+
+  __sync_add_and_fetch (&mem_used[category], bytes);
+  total = __sync_add_and_fetch (&mem_total, bytes);
+  if (bytes <= 0) return(0);
+
+  peak = mem_peak[category];
+  while (mem_used[category] > peak && !__sync_bool_compare_and_swap (&mem_peak[category], peak, mem_used[category])) {
+    peak = mem_peak[category];
+  }
+  peak = mem_peak_total;
+  while (total > peak && !__sync_bool_compare_and_swap (&mem_peak_total, peak, total)) {
+    peak = mem_peak_total;
+  }
+
+  return(mem_limit > 0 && total > mem_limit);
+}
+
+static void mem_over (int category, long long bytes) {
+  char b1[32], b2[32];
+
+  mem_report (stderr);
+  Fail("Tracked memory %s is over --mem-limit %s while allocating %s\n",
+       format_size((double)(mem_total + bytes), b1), format_size((double)mem_limit, b2), category_names[category]);
+}
+
+void mem_track (int category, long long bytes) {
+  if (mem_add (category, bytes)) mem_over (category, 0);
+}
+
+/* Header plus size bytes, tracked; over the limit the block is released
+   before failing */
+void *mem_alloc (int category, size_t size) {
+  mem_header_t *h;
+
+  h = MallocOrDie(sizeof(mem_header_t) + size);
+  h->size = (long long)size;
+  h->category = category;
+  if (mem_add (category, (long long)size)) {
+    mem_add (category, -(long long)size);
+    free(h);
+    mem_over (category, (long long)size);
+  }
+  return((void *)(h+1));
+}
+
+void mem_free (void *p) {
+  mem_header_t *h;
+
+  if (p == NULL) return;
+  h = ((mem_header_t *)p) - 1;
+  mem_track ((int)h->category, -h->size);
+  free(h);
+}
+
+/*
+ * Grows the results array kept in r (zeroed to start with) to at least
+ * size bytes, keeping what is in it.  Returns NULL if it cannot be had,
+ * as realloc would, leaving r as it was.  When the plan spills results,
+ * the array is a shared mapping of an unlinked temporary file (in
+ * $TMPDIR, or /tmp), so its pages can be written back to disk instead of
+ * counting against memory; growing it extends the file and maps it
+ * again, with no copy.
+ */
+void *mem_grow_results (mem_results_t *r, size_t size) {
+  char *dir, *fname;
+  mem_header_t *h;
+  void *base;
+
+  if (r->base != NULL && size <= r->size) return(r->base);
+  if (size == 0) size = 1;      /* mmap refuses empty mappings */
+  if (r->base == NULL && spill_results) {
+    dir = getenv("TMPDIR");
+    if (dir == NULL) dir = "/tmp";
+    fname = MallocOrDie(strlen(dir) + 32);
+    sprintf (fname, "%s/eqtl-results-XXXXXX", dir);
+    r->fd = mkstemp(fname);
+    if (r->fd < 0) {
+      free(fname);
+      return(NULL);
+    }
+    unlink(fname);
+    free(fname);
+    r->mapped = 1;
+  }
+
+  if (r->mapped) {
+    if (ftruncate(r->fd, (off_t)size) != 0) return(NULL);
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (base == MAP_FAILED) return(NULL);
+    if (r->base != NULL) munmap (r->base, r->size);
+  } else {
+    if (mem_add (MEM_RESULTS, (long long)(size - r->size))) {
+      mem_add (MEM_RESULTS, -(long long)(size - r->size));
+      mem_over (MEM_RESULTS, (long long)(size - r->size));
+    }
+    h = realloc(r->base != NULL ? ((mem_header_t *)r->base) - 1 : NULL, sizeof(mem_header_t) + size);
+    if (h == NULL) {
+      mem_add (MEM_RESULTS, -(long long)(size - r->size));
+      return(NULL);
+    }
+    h->size = (long long)size;
+    h->category = MEM_RESULTS;
+    base = (void *)(h+1);
+  }
+  r->base = base;
+  r->size = size;
+  return(base);
+}
+
+void mem_free_results (mem_results_t *r) {
+  if (r->mapped) {
+    if (r->base != NULL) munmap (r->base, r->size);
+    close(r->fd);
+  } else if (r->base != NULL) {
+    mem_free (r->base);
+  }
+  r->base = NULL;
+  r->size = 0;
+  r->mapped = 0;
+}
+
+void mem_report (FILE *f) {
+  char b1[32], b2[32];
+  int c;
+
+  fprintf (f, "Peak tracked memory %s (plan %s):", format_size((double)mem_peak_total, b1),
+	   format_size((double)mem_planned, b2));
+  for (c=0; c<MEM_CATEGORIES; c++) {
+    fprintf (f, " %s %s", category_names[c], format_size((double)mem_peak[c], b1));
+  }
+  fprintf (f, "\n");
+}
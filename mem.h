@@ -0,0 +1,77 @@
+/*
+ * mem.h
+ *
+ * Memory budget: planning a run's footprint against --mem-limit before
+ * anything is loaded, and tracking the large allocations against it.
+ */
+
+#ifndef _mem_h
+#define _mem_h
+
+#include <stdio.h>
+
+#include "structs.h"
+
+#define MEM_GENOTYPES 0
+#define MEM_PHENOTYPES 1
+#define MEM_RESULTS 2
+#define MEM_SCRATCH 3
+#define MEM_CATEGORIES 4
+
+/* What a run looks like, from the input files and options */
+typedef struct _mem_shape_t {
+  long long num_snps;
+  long long num_indivs;         /* Upper bound for a .ped */
+  long long num_phens;          /* Largest dataset */
+  int num_datasets;
+  int test_type;
+  int cis_only;
+  int dedup;
+  int prescreen;
+  int conditional;
+  int can_stream;               /* A .bed/.bim/.fam fileset exists */
+} mem_shape_t;
+
+/* How to run it.  mem_plan starts from the options asked for and
+   changes them only as needed to fit the limit */
+typedef struct _mem_plan_t {
+  long long limit;              /* Bytes, 0 for none */
+  long long need[MEM_CATEGORIES];
+  int streaming;
+  int block_size;
+  int use_hist;
+  int spill;                    /* Results in a file-backed mapping */
+  int num_threads;
+} mem_plan_t;
+
+long long mem_parse_size (char *s);
+
+void mem_shape_from_files (mem_shape_t *shape, char *prefix, dataset_t *datasets, int num_datasets);
+
+int mem_plan (mem_plan_t *plan, mem_shape_t *shape);
+
+void mem_print_plan (FILE *f, mem_plan_t *plan, mem_shape_t *shape);
+
+void mem_enforce (mem_plan_t *plan);
+
+void *mem_alloc (int category, size_t size);
+
+void mem_free (void *p);
+
+void mem_track (int category, long long bytes);
+
+/* A run's results array, in memory or spilled to a file-backed mapping */
+typedef struct _mem_results_t {
+  void *base;
+  size_t size;
+  int mapped;
+  int fd;                       /* Backing file, if mapped */
+} mem_results_t;
+
+void *mem_grow_results (mem_results_t *r, size_t size);
+
+void mem_free_results (mem_results_t *r);
+
+void mem_report (FILE *f);
+
+#endif
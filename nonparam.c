@@ -1,5 +1,5 @@
 /*
- * nonparam.h
+ * nonparam.c
  *
  * Routines for simple nonparametric statistics
  *
@@ -12,87 +12,101 @@
 #include <math.h>
 #include <gsl/gsl_cdf.h>
 #include "nonparam.h"
+#include "kernel.h"
+
+static __thread float *sort_vals;      /* For val_sort_func */
+
+/* By value, then index, so tied values keep their input order */
+static int val_sort_func (const void *a, const void *b) {
+  int i, j;
+
+  i = *((int *)a);
+  j = *((int *)b);
+
+  if (sort_vals[i] < sort_vals[j]) {
+    return(-1);
+  } else if (sort_vals[i] > sort_vals[j]) {
+    return(1);
+  } else {
+    return(i < j ? -1 : (i > j));
+  }
+}
+
+/*
+ * Puts the indices of vals in ascending order of value into order.  Done
+ * once per probe; nonparam_compar then ranks any SNP's called
+ * individuals from it without sorting.
+ */
+void nonparam_order (float *vals, int n, int *order) {
+  int i;
+
+  for (i=0; i<n; i++) {
+    order[i] = i;
+  }
+  sort_vals = vals;
+  qsort (order, n, sizeof(int), &val_sort_func);
+  sort_vals = NULL;
+}
 
 /* 
  * Given a list of values and groupings, does kruskal-wallis
  * if 3 groups or Mann-Whitney if 2.  Returns p-value.  Includes
  * a small value flag if p-value is to be believed.  Computes rank sum for both
- * in main routine b/c code is the same.
+ * in main routine b/c code is the same.  order is nonparam_order() of
+ * vals over all n individuals; those with group 127 (missing) are skipped
+ * as it is walked, so each SNP's ranks cost O(n).  If stats is not NULL,
+ * it gets the group counts and mean ranks.
  */
-double nonparam_compar (float *vals, char *groups, int n, int num_groups, int *sort_index, float *rank, int *tie_counts, int *flag) {
+KERNEL_CLONES
+double nonparam_compar (float *vals, char *groups, int n, int num_groups, int *order, int *tie_counts, int *flag, pair_stats_t *stats) {
   float H, U;
-  int i, j, sum, tot_ties;
+  int i, j, k, m, sum, tot_ties;
   float avg_rank;
+  double tie_sum;
   float rank_sum[3];
   float n_i[3];
 
-  /* First sort the data */
-  for (i=0; i<n; i++) {
-    sort_index[i] = i;
-  }
-  int sort_func (const void *a, const void *b) {
-    int i, j;
-
-    i = *((int *)a);
-    j = *((int *)b);
-
-    if (vals[i] < vals[j]) {
-      return(-1);
-    } else if (vals[i] > vals[j]) {
-      return(1);
-    } else {
-      return (0);
-    }
-  }
-  qsort (sort_index, n, sizeof(int), &sort_func);
-
-  /* Remove missing indivs (group = 127) from sort index */
-  i=0; j=0; 
-  while (i<n) {
-    if ((int)groups[sort_index[i]] != 127) {
-      sort_index[j] = sort_index[i];
-      j++;
-    }
-    i++;
-  }
-  n = j;
-
-  /* Set up tie counts */
-  for (i=0; i<n; i++) {
-    tie_counts[i] = 0;
+  for (i=0; i<3; i++) {
+    n_i[i] = 0;
+    rank_sum[i] = 0.;
   }
   tot_ties = 0;
 
-  /* Compute ranks */
-  for (i=0; i<n; i++) {
-    if (vals[sort_index[i]] != vals[sort_index[i+1]]) {
-      rank[sort_index[i]] = i + 1.;
-    } else {
-      sum = 0;
-      j = i;
-      while (j<n && vals[sort_index[i]] == vals[sort_index[j]]) {
-	sum += (j+1);
-	j++;
+  /* Ranks among the called individuals: walk each run of equal values,
+     counting the called ones, and give them the run's average rank.  m
+     is the number ranked so far */
+  m = 0;
+  for (i=0; i<n; i=j) {
+    sum = 0;
+    k = 0;
+    for (j=i; j<n && vals[order[j]] == vals[order[i]]; j++) {
+      if ((int)groups[order[j]] != 127) {
+	k++;
+	sum += m + k;
       }
-      avg_rank = (float)sum / (j-i);
-      tie_counts[tot_ties] = j-i;
-      tot_ties++;
-      while (i<j) {
-	rank[sort_index[i]] = avg_rank;
-	i++;
+    }
+    if (k == 0) continue;
+    if (k == 1) {
+      avg_rank = m + 1.;
+    } else {
+      avg_rank = (float)sum / k;
+      tie_counts[tot_ties++] = k;
+    }
+    for (k=i; k<j; k++) {
+      if ((int)groups[order[k]] != 127) {
+	n_i[(int)groups[order[k]]]++;
+	rank_sum[(int)groups[order[k]]] += avg_rank;
+	m++;
       }
-      i--;
     }
   }
+  n = m;
 
-  /* Compute rank sums and n_i */
-  for (i=0; i<3; i++) {
-    n_i[i] = 0;
-    rank_sum[i] = 0.;
-  }
-  for (i=0; i<n; i++) {
-    n_i[(int)groups[sort_index[i]]]++;
-    rank_sum[(int)groups[sort_index[i]]] += rank[sort_index[i]];
+  if (stats != NULL) {
+    for (i=0; i<3; i++) {
+      stats->n[i] = (int)n_i[i];
+      stats->mean_rank[i] = n_i[i] > 0 ? rank_sum[i]/n_i[i] : 0.;
+    }
   }
 
   *flag = 0;
@@ -108,17 +122,16 @@ double nonparam_compar (float *vals, char *groups, int n, int num_groups, int *s
     /* subtract out mean */
     U -= (0.5*n_i[0]*n_i[1]);
     
-    /* Use H for std. deviation here */
+    /* Use H for the variance here, less the correction for ties:
+       n0*n1*(n+1)/12 - n0*n1*sum(t^3-t)/(12*n*(n-1)) */
+    H = n_i[0]*n_i[1]*(n+1.)/12.;
     if (tot_ties > 0) {
+      tie_sum = 0.;
       for (i=0; i<tot_ties; i++) {
-	H += ((float)(tie_counts[i]*(tie_counts[i]+1)*(tie_counts[i]-1)))/12.;
+	tie_sum += (double)tie_counts[i]*tie_counts[i]*tie_counts[i] - tie_counts[i];
       }
-      H *= ((float)(n_i[0]*n_i[1]))/((float)(n*(n-1)));
-      H *= -1.;
-    } else {
-      H = 0.;
+      H -= n_i[0]*n_i[1]*tie_sum/(12.*n*(n-1.));
     }
-    H += ((float)(n_i[0]*n_i[1]*(n+1)))/12.;
     U /= sqrtf(H);
     *flag = -1;
 
@@ -149,3 +162,23 @@ double nonparam_compar (float *vals, char *groups, int n, int num_groups, int *s
     return(-1.);
   }
 }
+
+/*
+ * Median expression of each genotype group, from the value order and the
+ * counts nonparam_compar() put in stats.  One pass: the k-th called
+ * member of a group in value order is its k-th smallest.
+ */
+void nonparam_medians (float *vals, char *groups, int n, int *order, pair_stats_t *stats) {
+  int seen[3] = {0, 0, 0};
+  int i, g;
+
+  for (g=0; g<3; g++) stats->median[g] = 0.;
+  for (i=0; i<n; i++) {
+    g = (int)groups[order[i]];
+    if (g == 127) continue;
+    if (seen[g] == (stats->n[g]-1)/2) stats->median[g] += vals[order[i]];
+    if (seen[g] == stats->n[g]/2) stats->median[g] += vals[order[i]];
+    seen[g]++;
+  }
+  for (g=0; g<3; g++) stats->median[g] *= 0.5;
+}
@@ -13,7 +13,13 @@
 #ifndef _nonparam_h
 #define _nonparam_h
 
+#include "structs.h"
+
+void nonparam_order (float *vals, int n, int *order);
+
 double nonparam_compar (float *vals, char *groups, int n, int num_groups\
-		       , int *sort_index, float *rank, int *tie_counts, int *flag);
+		       , int *order, int *tie_counts, int *flag, pair_stats_t *stats);
+
+void nonparam_medians (float *vals, char *groups, int n, int *order, pair_stats_t *stats);
 
 #endif
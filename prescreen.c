@@ -0,0 +1,226 @@
+/*
+ * prescreen.c
+ *
+ * Cheap first-stage screen for trans scans.  Both tests reduce to a few
+ * dot products of the genotype vector g with a per-probe vector v
+ * computed once up front, taken over the called individuals only:
+ *   sum(g*v), sum((g==2)*v), sum(v) and sum(v^2)
+ * With v = centered expression, these give the regression r^2 exactly;
+ * with v = mid-ranks of the expression over all individuals, they give
+ * the group rank sums and hence the K-W H or M-W z, exactly for a SNP
+ * with no missing calls.  With m missing calls each individual's rank
+ * among the called is its rank here less something in [0, m], which
+ * bounds the statistic instead.  Pairs whose statistic cannot reach MAXP,
+ * allowing some slack for rounding, are skipped; the rest get the exact
+ * test, so the set of results is the same as a full scan.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <gsl/gsl_cdf.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "structs.h"
+#include "prescreen.h"
+#include "mem.h"
+#include "kernel.h"
+
+typedef struct _val_index_t {
+  float val;
+  int index;
+} val_index_t;
+
+static int val_index_sort_func (const void *a, const void *b) {
+  float i, j;
+
+  i = ((val_index_t *)a)->val;
+  j = ((val_index_t *)b)->val;
+  if (i < j) {
+    return(-1);
+  } else if (i > j) {
+    return(1);
+  } else {
+    return(0);
+  }
+}
+
+/* Mid-ranks of vals (1-based, ties averaged) into rank; returns the sum
+   of t^3 - t over runs of ties */
+static double mid_ranks (float *vals, int n, float *rank, val_index_t *tmp) {
+  int i, j, k;
+  double tie_term = 0.;
+  double t;
+
+  for (i=0; i<n; i++) {
+    tmp[i].val = vals[i];
+    tmp[i].index = i;
+  }
+  qsort (tmp, n, sizeof(val_index_t), &val_index_sort_func);
+  for (i=0; i<n; i=j) {
+    for (j=i+1; j<n && tmp[j].val == tmp[i].val; j++);
+    for (k=i; k<j; k++) {
+      rank[tmp[k].index] = (float)(0.5*(i + 1 + j));
+    }
+    t = j - i;
+    tie_term += t*t*t - t;
+  }
+  return(tie_term);
+}
+
+prescreen_t *prescreen_new (phen_t **phens, int num_phens, int num_indivs, int test_type) {
+  prescreen_t *pre;
+  val_index_t *tmp;
+  double n = num_indivs;
+  double t_crit, v;
+  int p, i;
+
+  pre = MallocOrDie(sizeof(prescreen_t));
+  pre->test_type = test_type;
+  pre->num_indivs = num_indivs;
+  pre->v = MallocOrDie(sizeof(float *)*num_phens);
+  pre->tie_term = MallocOrDie(sizeof(double)*num_phens);
+  tmp = MallocOrDie(sizeof(val_index_t)*num_indivs);
+
+  for (p=0; p<num_phens; p++) {
+    pre->tie_term[p] = 0.;
+    pre->v[p] = mem_alloc(MEM_SCRATCH, sizeof(float)*num_indivs);
+    if (test_type == 0) {
+      pre->tie_term[p] = mid_ranks (phens[p]->values, num_indivs, pre->v[p], tmp);
+    } else {
+      /* Centered, so that sums over the called individuals in single
+	 precision do not cancel */
+      v = 0.;
+      for (i=0; i<num_indivs; i++) v += phens[p]->values[i];
+      v /= n;
+      for (i=0; i<num_indivs; i++) pre->v[p][i] = (float)(phens[p]->values[i] - v);
+    }
+  }
+  free(tmp);
+
+  /* Thresholds on each statistic equivalent to p <= MAXP */
+  t_crit = gsl_cdf_tdist_Qinv(MAXP/2., n - 2.);
+  pre->r2_thr = t_crit*t_crit / (t_crit*t_crit + n - 2.);
+  pre->h_thr = -2.*log(MAXP);
+  pre->z_thr = gsl_cdf_ugaussian_Qinv(MAXP/2.);
+
+  /* The exact K-W and M-W statistics are accumulated in floats, with rank
+     sums up to n^2/2, so allow slack growing with n */
+  pre->h_margin = 0.01 + 1e-6*n*n;
+  pre->z_margin = 0.01 + 3e-7*n*sqrt(n);
+  return(pre);
+}
+
+/* Group counts and genotype sums over the called individuals of one SNP */
+void prescreen_snp (prescreen_snp_t *ps, snp_t *snp, int num_indivs) {
+  int counts[3];
+  int i, g;
+
+  counts[0] = counts[1] = counts[2] = 0;
+  ps->usable = 1;
+  ps->num_missing = 0;
+  for (i=0; i<num_indivs; i++) {
+    g = (int)snp->gt[i];
+    if (g == 127) {
+      ps->num_missing++;
+      continue;
+    }
+    if (g < 0 || g > 2) {
+      ps->usable = 0;
+      return;
+    }
+    counts[g]++;
+  }
+  for (g=0; g<3; g++) ps->n_i[g] = counts[g];
+  ps->sum_x = counts[1] + 2.*counts[2];
+  ps->sum_x2 = counts[1] + 4.*counts[2];
+}
+
+/* The stage one kernel: sum(g*v), sum((g==2)*v), sum(v) and sum(v^2)
+   over the called individuals, missing calls masked out, no branches */
+KERNEL_CLONES
+static void prescreen_sums (char *g, float *v, int n, double *sums) {
+  double a = 0., b = 0., c = 0., d = 0.;
+  float cv;
+  int i;
+
+  for (i=0; i<n; i++) {
+    cv = (float)(g[i] != 127) * v[i];
+    a += (double)(g[i] * cv);
+    b += (double)((g[i] == 2) * v[i]);
+    c += (double)cv;
+    d += (double)(cv * v[i]);
+  }
+  sums[0] = a;
+  sums[1] = b;
+  sums[2] = c;
+  sums[3] = d;
+}
+
+/*
+ * Returns 1 if the pair of probe phen_index and snp might reach p <= MAXP
+ * and needs the exact test, 0 if it certainly does not.  Comparisons are
+ * written so that a NaN in the expression values lets the pair through.
+ */
+int prescreen_pass (prescreen_t *pre, int phen_index, prescreen_snp_t *ps, snp_t *snp) {
+  double n = ps->n_i[0] + ps->n_i[1] + ps->n_i[2];
+  double sums[4];
+  double sxx, syy, sxy;
+  double r[3], ssb, sst, h;
+  int g, k;
+
+  if (!ps->usable || n < 3.) return(1);
+  prescreen_sums (snp->gt, pre->v[phen_index], pre->num_indivs, sums);
+
+  /* r2_thr is for all individuals; with fewer called the exact test
+     needs more, so the screen only errs towards the exact test */
+  if (pre->test_type == 1) {
+    sxx = ps->sum_x2 - ps->sum_x*ps->sum_x/n;
+    syy = sums[3] - sums[2]*sums[2]/n;
+    sxy = sums[0] - ps->sum_x*sums[2]/n;
+    if (sxx <= 0. || syy <= 0.) return(1);
+    return(!(sxy*sxy/(sxx*syy) < pre->r2_thr*(1. - 1e-3)));
+  }
+
+  /* Group rank sums, and their between-group sum of squares */
+  r[2] = sums[1];
+  r[1] = sums[0] - 2.*sums[1];
+  r[0] = sums[2] - r[1] - r[2];
+  ssb = -sums[2]*sums[2]/n;
+  k = 0;
+  for (g=0; g<3; g++) {
+    if (ps->n_i[g] == 0) continue;
+    ssb += r[g]*r[g]/ps->n_i[g];
+    k++;
+  }
+  if (k < snp->num_groups || k < 2) return(1);
+  if (ssb < 0.) ssb = 0.;
+
+  /* The tie-corrected K-W H, and the M-W z^2, are (n-1)*ssb/sst on the
+     ranks among the called.  Those are these ranks less up to
+     num_missing, which moves sqrt(ssb) by at most num_missing*sqrt(n)/2;
+     dropping individuals only shrinks the tie term, so sst is at least
+     as below.  With no missing calls this is the statistic itself */
+  sst = (n*n*n - n - pre->tie_term[phen_index])/12.;
+  if (!(sst > 0.)) return(1);
+  h = sqrt(ssb) + 0.5*ps->num_missing*sqrt(n);
+  h = (n - 1.)*h*h/sst;
+
+  if (snp->num_groups == 3) {
+    return(!(h < pre->h_thr - pre->h_margin));
+  } else if (snp->num_groups == 2) {
+    return(!(sqrt(h) < pre->z_thr - pre->z_margin));
+  }
+  return(1);
+}
+
+void prescreen_free (prescreen_t *pre, int num_phens) {
+  int p;
+
+  for (p=0; p<num_phens; p++) mem_free(pre->v[p]);
+  free(pre->v);
+  free(pre->tie_term);
+  free(pre);
+}
@@ -0,0 +1,45 @@
+/*
+ * prescreen.h
+ *
+ * Cheap first-stage screen for trans scans: a bound on each pair's
+ * statistic from a couple of dot products, so only pairs that can reach
+ * MAXP get the exact test.
+ */
+
+#ifndef _prescreen_h
+#define _prescreen_h
+
+#include "structs.h"
+
+typedef struct _prescreen_t {
+  int test_type;
+  int num_indivs;
+  float **v;            /* Per probe: ranks (K-W) or centered values */
+  double *tie_term;     /* Per probe: sum of t^3 - t over tied runs (K-W) */
+  double r2_thr;        /* Regression: r^2 needed to reach MAXP */
+  double h_thr;         /* K-W: H needed to reach MAXP */
+  double z_thr;         /* M-W: |z| needed to reach MAXP */
+  double h_margin;      /* Slack for single precision rounding in the */
+  double z_margin;      /*   exact K-W/M-W statistics */
+} prescreen_t;
+
+/* Genotype summaries over the called individuals of one SNP; usable is
+   0 if it has a call the tests do not know, in which case it always gets
+   the exact test */
+typedef struct _prescreen_snp_t {
+  int usable;
+  int num_missing;
+  int n_i[3];
+  double sum_x;
+  double sum_x2;
+} prescreen_snp_t;
+
+prescreen_t *prescreen_new (phen_t **phens, int num_phens, int num_indivs, int test_type);
+
+void prescreen_snp (prescreen_snp_t *ps, snp_t *snp, int num_indivs);
+
+int prescreen_pass (prescreen_t *pre, int phen_index, prescreen_snp_t *ps, snp_t *snp);
+
+void prescreen_free (prescreen_t *pre, int num_phens);
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * qc.c
+ *
+ * SNP quality control filters (call rate, minor allele frequency,
+ * Hardy-Weinberg equilibrium) applied after loading genotypes.
+ * Everything is computed from the per-SNP genotype counts that
+ * recode_gt fills in, so no pass over the genotypes is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "structs.h"
+#include "qc.h"
+
+/*
+ * Exact test for Hardy-Weinberg equilibrium, from Wigginton, Cutler and
+ * Abecasis (2005) Am J Hum Genet 76:887-893.  Returns the probability of
+ * a configuration at least as unlikely as the one observed given the
+ * allele counts.
+ */
+double hwe_exact_p (int obs_hets, int obs_hom1, int obs_hom2) {
+  int obs_homc, obs_homr;
+  int rare_copies, genotypes;
+  int mid, curr_hets, curr_homr, curr_homc;
+  double *het_probs;
+  double sum, p_hwe;
+  int i;
+
+  obs_homc = obs_hom1 < obs_hom2 ? obs_hom2 : obs_hom1;
+  obs_homr = obs_hom1 < obs_hom2 ? obs_hom1 : obs_hom2;
+  rare_copies = 2*obs_homr + obs_hets;
+  genotypes = obs_hets + obs_homc + obs_homr;
+  if (genotypes == 0) return(1.);
+
+  het_probs = MallocOrDie(sizeof(double)*(rare_copies+1));
+  for (i=0; i<=rare_copies; i++) het_probs[i] = 0.;
+
+  /* Start at midpoint, with the right parity */
+  mid = (int)((long long)rare_copies * (2*genotypes - rare_copies) / (2*genotypes));
+  if ((rare_copies & 1) ^ (mid & 1)) mid++;
+
+  curr_hets = mid;
+  curr_homr = (rare_copies - mid) / 2;
+  curr_homc = genotypes - curr_hets - curr_homr;
+
+  het_probs[mid] = 1.0;
+  sum = het_probs[mid];
+  for (curr_hets = mid; curr_hets > 1; curr_hets -= 2) {
+    het_probs[curr_hets - 2] = het_probs[curr_hets] * curr_hets * (curr_hets - 1.0)
+      / (4.0 * (curr_homr + 1.0) * (curr_homc + 1.0));
+    sum += het_probs[curr_hets - 2];
+    curr_homr++;
+    curr_homc++;
+  }
+
+  curr_hets = mid;
+  curr_homr = (rare_copies - mid) / 2;
+  curr_homc = genotypes - curr_hets - curr_homr;
+  for (curr_hets = mid; curr_hets <= rare_copies - 2; curr_hets += 2) {
+    het_probs[curr_hets + 2] = het_probs[curr_hets] * 4.0 * curr_homr * curr_homc
+      / ((curr_hets + 2.0) * (curr_hets + 1.0));
+    sum += het_probs[curr_hets + 2];
+    curr_homr--;
+    curr_homc--;
+  }
+
+  p_hwe = 0.;
+  for (i=0; i<=rare_copies; i++) {
+    if (het_probs[i] <= het_probs[obs_hets]) p_hwe += het_probs[i];
+  }
+  p_hwe /= sum;
+  free(het_probs);
+
+  return(p_hwe > 1.0 ? 1.0 : p_hwe);
+}
+
+/*
+ * Drops SNPs that fail any of the filters from the array snps, in the
+ * order call rate (missing fraction > max_missing), MAF < min_maf, then
+ * HWE p < min_hwe_p, tallying how many each filter removed.  Dropped SNPs
+ * lose their gt pointer.  Returns the number of SNPs kept, which are
+ * compacted to the front of snps in their original order.
+ */
+int qc_filter_block (qc_opts_t *qc, snp_t **snps, int num_snps) {
+  snp_t *cur;
+  int n_called, fail;
+  double maf;
+  int *c;
+  int i, kept;
+
+  kept = 0;
+  for (i=0; i<num_snps; i++) {
+    cur = snps[i];
+    c = cur->geno_counts;
+    n_called = c[0] + c[1] + c[2];
+    fail = -1;
+
+    if (cur->num_indivs > 0 && ((double)c[3])/cur->num_indivs > qc->max_missing) {
+      fail = 0;
+    } else if (n_called == 0) {
+      fail = 1;
+    } else {
+      maf = ((double)(2*c[0] + c[1]))/(2.*n_called);
+      if (maf > 0.5) maf = 1. - maf;
+      if (maf < qc->min_maf) {
+	fail = 1;
+      } else if (qc->min_hwe_p > 0. && hwe_exact_p(c[1], c[0], c[2]) < qc->min_hwe_p) {
+	fail = 2;
+      }
+    }
+
+    if (fail >= 0) {
+      qc->removed[fail]++;
+      cur->gt = NULL;
+    } else {
+      snps[kept++] = cur;
+    }
+  }
+  return(kept);
+}
+
+void qc_print_summary (FILE *f, qc_opts_t *qc) {
+  fprintf (f, "QC removed %d snps: %d for missingness > %g, %d for MAF < %g, %d for HWE p < %g\n",
+	  qc->removed[0] + qc->removed[1] + qc->removed[2], qc->removed[0], qc->max_missing,
+	  qc->removed[1], qc->min_maf, qc->removed[2], qc->min_hwe_p);
+}
@@ -0,0 +1,28 @@
+/*
+ * qc.h
+ *
+ * SNP quality control filters (call rate, minor allele frequency,
+ * Hardy-Weinberg equilibrium) applied after loading genotypes.
+ */
+
+#ifndef _qc_h
+#define _qc_h
+
+#include <stdio.h>
+
+#include "structs.h"
+
+typedef struct _qc_opts_t {
+  double min_maf;         /* Minimum minor allele frequency */
+  double max_missing;     /* Maximum fraction of missing calls */
+  double min_hwe_p;       /* Minimum HWE exact test p */
+  int removed[3];         /* SNPs dropped for missingness, MAF and HWE */
+} qc_opts_t;
+
+double hwe_exact_p (int obs_hets, int obs_hom1, int obs_hom2);
+
+int qc_filter_block (qc_opts_t *qc, snp_t **snps, int num_snps);
+
+void qc_print_summary (FILE *f, qc_opts_t *qc);
+
+#endif
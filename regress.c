@@ -13,62 +13,92 @@
 
 #include <gsl/gsl_cdf.h>
 
+#include "regress.h"
+#include "kernel.h"
+
+/*
+ * The genotype-only part of the regression: number of called
+ * individuals, sum(x), sum(x^2) and sum((x-xbar)^2).  These are the same
+ * for every probe a SNP is tested against.
+ */
+KERNEL_CLONES
+void regress_gt_sums (char *gts, int n_tot, regress_gt_t *s) {
+  int i, g;
+  double mean;
+
+  s->n = 0;
+  s->sum_x = 0;
+  s->sum_x2 = 0;
+  for (i=0; i<n_tot; i++) {
+    g = (int)(gts[i]);
+    if (g != 127) {
+      s->n++;
+      s->sum_x += g;
+      s->sum_x2 += g*g;
+    }
+  }
+
+  s->sum_x_xbar = 0.;
+  mean = (1./s->n)*s->sum_x;
+  for (i=0; i<n_tot; i++) {
+    g = (int)(gts[i]);
+    if (g != 127) {
+      s->sum_x_xbar += (g-mean)*(g-mean);
+    }
+  }
+}
+
 /*
  * Computes regression line, and t-test for slope of line != 0
  * Algorithm taken from sections 7.8 and 8.8 of Hogg and Tanis,
  * Probability and Statistical Inference, 6th edition, and
  * validated by comparing on their test data with R's results on same
- * data
+ * data.  gs holds regress_gt_sums() of gts.  stats, if not NULL, gets
+ * the slope and its standard error.
  */
-float regression_significance (char *gts, float *vals, int n_tot) {
+KERNEL_CLONES
+float regression_significance_gt (char *gts, float *vals, int n_tot, regress_gt_t *gs, pair_stats_t *stats) {
   double sum_xy, sum_y, sum_y2;
-  int sum_x, sum_x2;
-  double sum_x_xbar;
+  int sum_x, n;
   int i;
   double beta_hat, n_sigma2_hat2;
-  double mean;
-  double t1;
-  int n, g;
+  double se, t1;
+  int g;
   double v;
 
   sum_xy = 0.;
   sum_y = 0.;
   sum_y2 = 0.;
-  sum_x = 0;
-  sum_x2 = 0;
-
-  n = 0;
+  sum_x = gs->sum_x;
+  n = gs->n;
 
   for (i=0; i<n_tot; i++) {
     g = (int)(gts[i]);
     if (g != 127) {
-      n++;
-
-      sum_x += g;
-      sum_x2 += g*g;
-
       v = (double)vals[i];
       sum_y += v;
       sum_y2 += v*v;
       sum_xy += v*g;
     }
   }
-  beta_hat = (sum_xy-sum_x*(sum_y/n))/(sum_x2-(1./n)*sum_x*sum_x);
+  beta_hat = (sum_xy-sum_x*(sum_y/n))/(gs->sum_x2-(1./n)*sum_x*sum_x);
 
   n_sigma2_hat2 = sum_y2 - sum_y*sum_y/n - beta_hat*sum_xy + (beta_hat*sum_x)*(sum_y/n);
 
-  sum_x_xbar = 0.;
-  mean = (1./n)*sum_x;
-  for (i=0; i<n_tot; i++) {
-    g = (int)(gts[i]);
-    if (g != 127) {
-      sum_x_xbar += (g-mean)*(g-mean);
-    }
+  se = sqrt(n_sigma2_hat2/((n-2)*gs->sum_x_xbar));
+  t1 = beta_hat/se;
+  if (stats != NULL) {
+    stats->beta = (float)beta_hat;
+    stats->se = (float)se;
   }
-
-  t1 = beta_hat/sqrt(n_sigma2_hat2/((n-2)*sum_x_xbar));
   return((float)(2*gsl_cdf_tdist_Q((double)fabs(t1), (double)(n-2))));
-  //return(1.);
+}
+
+float regression_significance (char *gts, float *vals, int n_tot) {
+  regress_gt_t gs;
+
+  regress_gt_sums (gts, n_tot, &gs);
+  return(regression_significance_gt (gts, vals, n_tot, &gs, NULL));
 }
   
   
@@ -10,6 +10,20 @@
 #ifndef _regress_h
 #define _regress_h
 
+#include "structs.h"
+
+/* Per-SNP sums reused across probes */
+typedef struct _regress_gt_t {
+  int n;
+  int sum_x;
+  int sum_x2;
+  double sum_x_xbar;
+} regress_gt_t;
+
 float regression_significance (char *gts, float *vals, int n);
 
+void regress_gt_sums (char *gts, int n_tot, regress_gt_t *s);
+
+float regression_significance_gt (char *gts, float *vals, int n_tot, regress_gt_t *gs, pair_stats_t *stats);
+
 #endif
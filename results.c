@@ -0,0 +1,211 @@
+/*
+ * results.c
+ *
+ * Routines for ordering the results of a scan and finding the
+ * Benjamini-Hochberg FDR threshold.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "structs.h"
+#include "results.h"
+#include "mem.h"
+
+#define RADIX_BITS 16
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+/* Maps a double onto an unsigned 64-bit integer whose ordering matches
+   the ordering of the doubles (negatives get all bits flipped, positives
+   just the sign bit), so the keys can be radix sorted as integers */
+static unsigned long long p_to_radix (double p) {
+  unsigned long long u;
+
+  memcpy (&u, &p, sizeof(u));
+  if (u >> 63) {
+    return(~u);
+  } else {
+    return(u | (1ULL << 63));
+  }
+}
+
+/*
+ * LSD radix sort of the packed (p, index) keys by ascending p, 16 bits
+ * per pass.  All digit histograms are built in one pass over the keys, and
+ * passes where every key shares the same digit are skipped (with p < 1 the
+ * top digit rarely varies much).  Sort is stable.
+ */
+void sort_result_keys (result_key_t *keys, long long n) {
+  long long *counts;
+  long long offset, c;
+  result_key_t *tmp, *src, *dst, *swap;
+  unsigned long long u;
+  int pass, d;
+  long long i;
+
+  if (n < 2) return;
+
+  counts = MallocOrDie(sizeof(long long)*RADIX_PASSES*RADIX_SIZE);
+  memset (counts, 0, sizeof(long long)*RADIX_PASSES*RADIX_SIZE);
+  for (i=0; i<n; i++) {
+    u = p_to_radix(keys[i].p);
+    for (pass=0; pass<RADIX_PASSES; pass++) {
+      counts[pass*RADIX_SIZE + ((u >> (pass*RADIX_BITS)) & (RADIX_SIZE-1))]++;
+    }
+  }
+
+  tmp = mem_alloc(MEM_RESULTS, sizeof(result_key_t)*n);
+  src = keys;
+  dst = tmp;
+  for (pass=0; pass<RADIX_PASSES; pass++) {
+    /* Skip the pass if all keys fall in one bucket */
+    u = p_to_radix(keys[0].p);
+    if (counts[pass*RADIX_SIZE + ((u >> (pass*RADIX_BITS)) & (RADIX_SIZE-1))] == n) continue;
+
+    /* Turn the histogram into bucket offsets */
+    offset = 0;
+    for (d=0; d<RADIX_SIZE; d++) {
+      c = counts[pass*RADIX_SIZE + d];
+      counts[pass*RADIX_SIZE + d] = offset;
+      offset += c;
+    }
+    for (i=0; i<n; i++) {
+      u = p_to_radix(src[i].p);
+      d = (int)((u >> (pass*RADIX_BITS)) & (RADIX_SIZE-1));
+      dst[counts[pass*RADIX_SIZE + d]++] = src[i];
+    }
+    swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != keys) {
+    memcpy (keys, src, sizeof(result_key_t)*n);
+  }
+  mem_free(tmp);
+  free(counts);
+}
+
+/* Which histogram bucket p falls in.  Monotone in p. */
+static int fdr_hist_bucket (double p) {
+  double l;
+  int b;
+
+  if (p < FDR_HIST_MIN_P) return(0);
+  l = (log10(p) + FDR_HIST_DECADES) * FDR_HIST_PER_DECADE;
+  b = (int)l + 1;
+  if (b >= FDR_HIST_BUCKETS) b = FDR_HIST_BUCKETS - 1;
+  return(b);
+}
+
+fdr_hist_t *fdr_hist_new (void) {
+  fdr_hist_t *hist;
+
+  hist = MallocOrDie(sizeof(fdr_hist_t));
+  memset (hist, 0, sizeof(fdr_hist_t));
+  return(hist);
+}
+
+static void fdr_bucket_add (fdr_bucket_t *bucket, double p) {
+  if (bucket->count == 0 || p < bucket->min_p) bucket->min_p = p;
+  if (bucket->count == 0 || p > bucket->max_p) bucket->max_p = p;
+  bucket->count++;
+}
+
+/* Record one result in the histogram, as it is stored */
+void fdr_hist_add (fdr_hist_t *hist, double p, int is_cis) {
+  int b;
+
+  b = fdr_hist_bucket(p);
+  fdr_bucket_add (&hist->all[b], p);
+  if (is_cis == 1) fdr_bucket_add (&hist->cis[b], p);
+}
+
+static int double_sort_func (const void *a, const void *b) {
+  double i, j;
+
+  i = *(double *)a;
+  j = *(double *)b;
+  if (i < j) {
+    return(-1);
+  } else if (i > j) {
+    return(1);
+  } else {
+    return(0);
+  }
+}
+
+/*
+ * Narrows down the B-H FDR cutoff from the histogram alone.  B-H wants
+ * the largest rank k with p_(k) <= k/m * FDR_ALPHA.  Walking buckets from
+ * the top with C(b) = results in buckets <= b:
+ *   - max_p(b) <= C(b)/m * alpha: p_(C(b)) = max_p(b) passes, so
+ *     everything in b and below is significant.
+ *   - min_p(b) >  C(b)/m * alpha: nothing in b can pass, go down.
+ *   - otherwise b straddles the threshold and only its p-values can say.
+ * The band runs from the highest straddling bucket down to just above the
+ * first bucket that passes whole; fdr_band_resolve finishes the job from
+ * the p-values in it, so the results need no pass of their own.  If cis
+ * is 1, only cis results are counted.
+ */
+void fdr_hist_band (fdr_hist_t *hist, double total_tests_d, int cis, fdr_band_t *band) {
+  fdr_bucket_t *buckets;
+  long long cum;
+  int b;
+
+  buckets = (cis == 1) ? hist->cis : hist->all;
+  cum = 0;
+  for (b=0; b<FDR_HIST_BUCKETS; b++) cum += buckets[b].count;
+
+  band->lo = FDR_HIST_BUCKETS;
+  band->hi = -1;
+  band->count = 0;
+  band->has_cutoff = 0;
+  band->cutoff = 0.;
+  for (b=FDR_HIST_BUCKETS-1; b>=0; b--) {
+    if (buckets[b].count == 0) continue;
+    if (buckets[b].max_p <= ((double)cum)/total_tests_d * FDR_ALPHA) {
+      band->cutoff = buckets[b].max_p;
+      band->has_cutoff = 1;
+      break;
+    }
+    if (band->hi < 0 && buckets[b].min_p <= ((double)cum)/total_tests_d * FDR_ALPHA) band->hi = b;
+    if (band->hi >= 0) {
+      band->lo = b;
+      band->count += buckets[b].count;
+    }
+    cum -= buckets[b].count;
+  }
+  band->below = cum;
+}
+
+/* Whether a result with this p is undecided by band */
+int fdr_band_has (fdr_band_t *band, double p) {
+  int b;
+
+  if (band->lo > band->hi) return(0);
+  b = fdr_hist_bucket(p);
+  return(b >= band->lo && b <= band->hi);
+}
+
+/* Sets the cutoff from the n p-values in band (which it sorts); a result
+   is then FDR significant iff has_cutoff and p <= cutoff, which marks the
+   same set as rank <= k */
+void fdr_band_resolve (fdr_band_t *band, double *vals, long long n, double total_tests_d) {
+  long long j;
+
+  qsort (vals, n, sizeof(double), &double_sort_func);
+  for (j=n-1; j>=0; j--) {
+    if (vals[j] <= ((double)(band->below + j + 1))/total_tests_d * FDR_ALPHA) {
+      band->cutoff = vals[j];
+      band->has_cutoff = 1;
+      return;
+    }
+  }
+}
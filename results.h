@@ -0,0 +1,55 @@
+/*
+ * results.h
+ *
+ * Routines for ordering the results of a scan and finding the
+ * Benjamini-Hochberg FDR threshold.
+ */
+
+#ifndef _results_h
+#define _results_h
+
+#include "structs.h"
+
+/* Log-scale p-value histogram: FDR_HIST_PER_DECADE buckets per decade
+   from 1e-FDR_HIST_DECADES up to 1, with bucket 0 holding everything
+   smaller (including p = 0) */
+#define FDR_HIST_PER_DECADE 256
+#define FDR_HIST_DECADES 40
+#define FDR_HIST_MIN_P 1e-40
+#define FDR_HIST_BUCKETS (FDR_HIST_PER_DECADE*FDR_HIST_DECADES + 2)
+
+typedef struct _fdr_bucket_t {
+  long long count;
+  double min_p;
+  double max_p;
+} fdr_bucket_t;
+
+typedef struct _fdr_hist_t {
+  fdr_bucket_t all[FDR_HIST_BUCKETS];
+  fdr_bucket_t cis[FDR_HIST_BUCKETS];
+} fdr_hist_t;
+
+/* What the histogram alone says about a B-H cutoff: results in buckets
+   lo..hi are undecided until their p-values are seen, those below pass
+   if has_cutoff, those above fail */
+typedef struct _fdr_band_t {
+  int lo, hi;                   /* lo > hi if nothing is undecided */
+  long long below;              /* Results in buckets under lo */
+  long long count;              /* Results in lo..hi */
+  double cutoff;
+  int has_cutoff;
+} fdr_band_t;
+
+void sort_result_keys (result_key_t *keys, long long n);
+
+fdr_hist_t *fdr_hist_new (void);
+
+void fdr_hist_add (fdr_hist_t *hist, double p, int is_cis);
+
+void fdr_hist_band (fdr_hist_t *hist, double total_tests_d, int cis, fdr_band_t *band);
+
+int fdr_band_has (fdr_band_t *band, double p);
+
+void fdr_band_resolve (fdr_band_t *band, double *vals, long long n, double total_tests_d);
+
+#endif
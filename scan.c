@@ -0,0 +1,538 @@
+/*
+ * scan.c
+ *
+ * Multithreaded scan of a block of SNPs against all probes.
+ *
+ * For a full (trans) scan the SNP x probe space is cut into tiles small
+ * enough that a tile's genotypes and expression values stay in L2, and
+ * threads pull tiles from a shared counter.  Probe-outer over the whole
+ * panel would stream every genotype through the cache once per probe;
+ * within a tile each genotype vector is reused for tile_phens probes and
+ * each expression vector for tile_snps SNPs.
+ *
+ * For a cis-only scan the block is sorted by position once and each probe
+ * binary searches its window, so only cis pairs are ever visited.  By
+ * gene, the search is done once for all of a gene's probes, and for
+ * regression each SNP's genotype sums are computed once per gene.
+ *
+ * For the interaction test, each SNP's part of the fit (inter_snp) is
+ * done once per block, shared out among the threads in chunks before any
+ * of them starts testing.
+ *
+ * With a prescreen, each trans pair first gets the cheap bound from
+ * prescreen.c and only pairs that might reach MAXP get the exact test.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "squid.h"
+#include "sqfuncs.h"
+
+#include "structs.h"
+#include "scan.h"
+#include "nonparam.h"
+#include "regress.h"
+#include "interact.h"
+#include "mem.h"
+#include "error.h"
+
+#define CIS_CHUNK 8             /* Probes per work unit in a cis scan */
+#define PREP_CHUNK 256          /* SNPs per work unit of inter_snp setup */
+
+/* Shared state for one block */
+typedef struct _block_work_t {
+  scan_ctx_t *ctx;
+  snp_t **block;
+  snp_t **reps;                 /* Trans: SNPs that carry a test */
+  int num_reps;
+  snp_t **cis_index;            /* Cis: all SNPs, sorted by position */
+  prescreen_snp_t *pre_snps;    /* Trans prescreen: by scan_index */
+  inter_snp_t *inter_snps;      /* Interaction: by scan_index */
+  int next_prep;                /* Next chunk of inter_snps to fill */
+  pthread_barrier_t prep_done;  /* Interaction: all of inter_snps filled */
+  int num_snps;
+  int num_stiles;
+  int num_tasks;
+  int next_task;
+  char error[256];              /* First Fail() in a worker */
+} block_work_t;
+
+typedef struct _scan_worker_t {
+  block_work_t *work;
+  int *tie_counts;
+  int *stamp;                   /* Cis: probe a rep was last tested on */
+  float *cached_p;
+  int *cached_flag;
+  pair_stats_t *cached_stats;
+  regress_gt_t *gt_sums;        /* By gene: by scan_index, for regression */
+  int *gt_stamp;                /* Gene gt_sums was last filled for */
+  regress_gt_t gs;              /* Regression sums when not by gene */
+  result_t *buf;
+  pair_stats_t *buf_stats;      /* Stats of buf's results */
+  int nbuf;
+  long long total_tests;
+  long long total_cis_tests;
+  long long screened_out;
+} scan_worker_t;
+
+int check_cis (snp_t *snp, phen_t *phen, int maxdist) {
+  int retval = 0;
+
+  if (snp->chr == phen->chr &&
+      (((snp->pos < phen->start) && (phen->start - snp->pos <= maxdist)) ||
+       ((snp->pos > phen->stop) && (snp->pos - phen->stop <= maxdist)) ||
+       ((snp->pos >= phen->start) && (snp->pos <= phen->stop)))) {
+    retval = 1;
+  }
+  return(retval);
+}
+
+/*
+ * Picks tile sizes from the L2 size and number of individuals: half of L2
+ * for a tile's genotypes (1 byte each) and a quarter for its expression
+ * values (4 bytes each), leaving the rest for the test's scratch arrays.
+ */
+void scan_choose_tiles (scan_ctx_t *ctx) {
+  long cache;
+  long n;
+
+  cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if (cache <= 0) cache = 256*1024;
+  n = ctx->num_indivs > 0 ? ctx->num_indivs : 1;
+
+  ctx->tile_snps = (int)((cache/2) / n);
+  ctx->tile_phens = (int)((cache/4) / (sizeof(float)*n));
+  if (ctx->tile_snps < 1) ctx->tile_snps = 1;
+  if (ctx->tile_phens < 1) ctx->tile_phens = 1;
+}
+
+int snp_pos_sort_func (const void *a, const void *b) {
+  snp_t *i, *j;
+
+  i = *(snp_t **)a;
+  j = *(snp_t **)b;
+  if (i->chr != j->chr) return(i->chr < j->chr ? -1 : 1);
+  if (i->pos != j->pos) return(i->pos < j->pos ? -1 : 1);
+  return(0);
+}
+
+/* Index of the first SNP at or after (chr, pos) in the sorted index */
+int cis_lower_bound (snp_t **index, int n, int chr, int pos) {
+  int lo = 0, hi = n, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo)/2;
+    if (index[mid]->chr < chr || (index[mid]->chr == chr && index[mid]->pos < pos)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return(lo);
+}
+
+/* Tests probe p_index against snp.  gs, if not NULL, holds
+   regress_gt_sums() of snp.  Fills stats; K-W medians take another pass,
+   so only pairs that will be kept get them */
+static float run_test (scan_worker_t *w, int p_index, snp_t *snp, regress_gt_t *gs, int *flag, pair_stats_t *stats) {
+  scan_ctx_t *ctx = w->work->ctx;
+  phen_t *phen = ctx->phens[p_index];
+  int *order;
+  float p = -1.0;
+
+  memset (stats, 0, sizeof(pair_stats_t));
+  switch (ctx->test_type) {
+  case 0:
+    order = ctx->orders + (size_t)p_index*ctx->num_indivs;
+    p = nonparam_compar(phen->values, snp->gt, ctx->num_indivs, snp->num_groups, order, w->tie_counts, flag, stats);
+    if (p <= MAXP) nonparam_medians (phen->values, snp->gt, ctx->num_indivs, order, stats);
+    break;
+  case 1 :
+    if (gs != NULL) {
+      p = regression_significance_gt (snp->gt, phen->values, ctx->num_indivs, gs, stats);
+    } else {
+      regress_gt_sums (snp->gt, ctx->num_indivs, &w->gs);
+      p = regression_significance_gt (snp->gt, phen->values, ctx->num_indivs, &w->gs, stats);
+    }
+    *flag = 0;
+    break;
+  case 2 :
+    p = inter_significance (snp->gt, phen->values, ctx->covariate, ctx->num_indivs, &w->work->inter_snps[snp->scan_index], stats);
+    *flag = 0;
+    break;
+  default :
+    Fail("No such test type %d\n", ctx->test_type);
+  }
+  return(p);
+}
+
+static void flush_results (scan_worker_t *w) {
+  scan_ctx_t *ctx = w->work->ctx;
+  int i;
+
+  if (w->nbuf == 0) return;
+  pthread_mutex_lock (&ctx->lock);
+  if (ctx->tot_results + w->nbuf > ctx->estimated_results) {
+    ctx->overflow = 1;          /* Raised by scan_block after the join */
+  } else {
+    memcpy (ctx->results + ctx->tot_results, w->buf, sizeof(result_t)*w->nbuf);
+    memcpy (ctx->stats + ctx->tot_results, w->buf_stats, sizeof(pair_stats_t)*w->nbuf);
+    ctx->tot_results += w->nbuf;
+    if (ctx->hist != NULL) {
+      for (i=0; i<w->nbuf; i++) fdr_hist_add (ctx->hist, w->buf[i].p, w->buf[i].good_for_cis);
+    }
+  }
+  pthread_mutex_unlock (&ctx->lock);
+  w->nbuf = 0;
+}
+
+static void record_test (scan_worker_t *w, snp_t *snp, phen_t *phen, float p, int flag, pair_stats_t *stats, int is_cis) {
+  result_t *res;
+
+  w->total_tests++;
+  if (is_cis == 1) {
+    w->total_cis_tests++;
+  }
+  if (p > 1.001) {
+    fprintf (stderr, "P>1\trs%d\t%s\t%g\n", snp->rs, phen->name, p);
+  }
+  if (p <= MAXP) {
+    if (w->nbuf == RESULT_BUF_SIZE) flush_results (w);
+    w->buf_stats[w->nbuf] = *stats;
+    res = &w->buf[w->nbuf++];
+    res->snp = snp;
+    res->phen = phen;
+    res->p = p;
+    res->flag = flag;
+    res->good_for_cis = is_cis;
+  }
+}
+
+/* Tests one representative SNP (and so all SNPs sharing its gt vector)
+   against probe p.  A pair the prescreen rules out is counted with p = 1 */
+static void test_rep (scan_worker_t *w, snp_t *rep, int p_index) {
+  scan_ctx_t *ctx = w->work->ctx;
+  phen_t *phen = ctx->phens[p_index];
+  snp_t *member;
+  float p = -1.0;
+  int flag = 0;
+  int is_cis;
+  int computed = 0;
+  pair_stats_t stats;
+
+  for (member = rep; member != NULL; member = member->dup_next) {
+    is_cis = check_cis(member, phen, ctx->maxdist);
+    if (is_cis == 0 && ctx->cis_only == 1) continue;
+    if (!computed) {
+      if (ctx->prescreen != NULL &&
+	  !prescreen_pass (ctx->prescreen, p_index, &w->work->pre_snps[rep->scan_index], rep)) {
+	p = 1.0;
+	memset (&stats, 0, sizeof(pair_stats_t));
+	w->screened_out++;
+      } else {
+	p = run_test (w, p_index, rep, NULL, &flag, &stats);
+      }
+      computed = 1;
+    }
+    record_test (w, member, phen, p, flag, &stats, is_cis);
+  }
+}
+
+/* Trans: task t is probe tile t / num_stiles by SNP tile t % num_stiles */
+static void do_tile (scan_worker_t *w, int t) {
+  block_work_t *work = w->work;
+  scan_ctx_t *ctx = work->ctx;
+  int p0, p1, s0, s1, p, s;
+
+  p0 = (t / work->num_stiles) * ctx->tile_phens;
+  p1 = p0 + ctx->tile_phens < ctx->num_phens ? p0 + ctx->tile_phens : ctx->num_phens;
+  s0 = (t % work->num_stiles) * ctx->tile_snps;
+  s1 = s0 + ctx->tile_snps < work->num_reps ? s0 + ctx->tile_snps : work->num_reps;
+
+  for (p=p0; p<p1; p++) {
+    for (s=s0; s<s1; s++) {
+      test_rep (w, work->reps[s], p);
+    }
+  }
+}
+
+/* Cis: tests probe p against the cis SNPs among cis_index[k0..k1).  SNPs
+   sharing a gt vector reuse the rep's p-value if it was already computed
+   for this probe.  With a gene, the gene's best pair is updated and
+   gt_sums holds the reps' genotype sums */
+static void cis_probe_range (scan_worker_t *w, int p, int k0, int k1, gene_t *gene) {
+  block_work_t *work = w->work;
+  scan_ctx_t *ctx = work->ctx;
+  phen_t *phen = ctx->phens[p];
+  snp_t *snp, *rep;
+  int k, idx;
+  float pval;
+  int flag;
+
+  for (k=k0; k<k1; k++) {
+    snp = work->cis_index[k];
+    if (!check_cis(snp, phen, ctx->maxdist)) continue;
+
+    rep = (snp->dup_rep != NULL) ? snp->dup_rep : snp;
+    idx = rep->scan_index;
+    if (w->stamp[idx] == p) {
+      pval = w->cached_p[idx];
+      flag = w->cached_flag[idx];
+    } else {
+      pval = run_test (w, p, rep, gene != NULL && w->gt_sums != NULL ? &w->gt_sums[idx] : NULL, &flag, &w->cached_stats[idx]);
+      w->stamp[idx] = p;
+      w->cached_p[idx] = pval;
+      w->cached_flag[idx] = flag;
+    }
+    record_test (w, snp, phen, pval, flag, &w->cached_stats[idx], 1);
+    if (gene != NULL) gene_update (gene, snp, phen, pval);
+  }
+}
+
+/* The range of cis_index on chr between lo and hi */
+static int cis_range (block_work_t *work, int chr, int lo, int hi, int *k1_r) {
+  int k0, k1;
+
+  k0 = cis_lower_bound(work->cis_index, work->num_snps, chr, lo);
+  for (k1=k0; k1 < work->num_snps && work->cis_index[k1]->chr == chr && work->cis_index[k1]->pos <= hi; k1++);
+  *k1_r = k1;
+  return(k0);
+}
+
+static void do_cis_probe (scan_worker_t *w, int p) {
+  scan_ctx_t *ctx = w->work->ctx;
+  phen_t *phen = ctx->phens[p];
+  int lo, hi, k0, k1;
+
+  lo = (phen->start < phen->stop ? phen->start : phen->stop) - ctx->maxdist;
+  hi = (phen->start < phen->stop ? phen->stop : phen->start) + ctx->maxdist;
+  k0 = cis_range (w->work, phen->chr, lo, hi, &k1);
+  cis_probe_range (w, p, k0, k1, NULL);
+}
+
+/* Cis by gene: one window lookup, and for regression one set of genotype
+   sums per SNP, shared by all of gene g's probes */
+static void do_cis_gene (scan_worker_t *w, int g) {
+  block_work_t *work = w->work;
+  scan_ctx_t *ctx = work->ctx;
+  gene_t *gene = &ctx->genes[g];
+  snp_t *rep;
+  int k0, k1, k, j;
+
+  k0 = cis_range (work, gene->chr, gene->lo - ctx->maxdist, gene->hi + ctx->maxdist, &k1);
+  if (k0 == k1) return;
+  if (w->gt_sums != NULL) {
+    for (k=k0; k<k1; k++) {
+      rep = (work->cis_index[k]->dup_rep != NULL) ? work->cis_index[k]->dup_rep : work->cis_index[k];
+      if (w->gt_stamp[rep->scan_index] == g) continue;
+      regress_gt_sums (rep->gt, ctx->num_indivs, &w->gt_sums[rep->scan_index]);
+      w->gt_stamp[rep->scan_index] = g;
+    }
+  }
+  for (j=0; j<gene->num_probes; j++) {
+    cis_probe_range (w, gene->probes[j], k0, k1, gene);
+  }
+}
+
+/* Interaction: fills inter_snps for the block's reps a chunk at a time,
+   then waits for the other workers to finish theirs */
+static void prep_inter (scan_worker_t *w) {
+  block_work_t *work = w->work;
+  scan_ctx_t *ctx = work->ctx;
+  snp_t *snp;
+  int c, k;
+
+  while (1) {
+    pthread_mutex_lock (&ctx->lock);
+    c = work->next_prep++;
+    pthread_mutex_unlock (&ctx->lock);
+    if ((long long)c*PREP_CHUNK >= work->num_snps) break;
+    for (k = c*PREP_CHUNK; k < (c+1)*PREP_CHUNK && k < work->num_snps; k++) {
+      snp = work->block[k];
+      if (snp->dup_rep == NULL || snp->dup_rep == snp) {
+	inter_snp (&work->inter_snps[k], snp->gt, ctx->covariate, ctx->num_indivs);
+      }
+    }
+  }
+  pthread_barrier_wait (&work->prep_done);
+}
+
+/* A Fail() in a worker is kept in work->error and stops the other
+   workers taking tasks; scan_block raises it after the join */
+static void *scan_worker (void *arg) {
+  scan_worker_t *w = (scan_worker_t *)arg;
+  block_work_t *work = w->work;
+  scan_ctx_t *ctx = work->ctx;
+  error_trap_t trap;
+  int t, p;
+
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    pthread_mutex_lock (&ctx->lock);
+    if (work->error[0] == '\0') snprintf (work->error, sizeof(work->error), "%s", error_message());
+    work->next_task = work->num_tasks;
+    pthread_mutex_unlock (&ctx->lock);
+    return(NULL);
+  }
+  if (work->inter_snps != NULL) prep_inter (w);
+  while (1) {
+    pthread_mutex_lock (&ctx->lock);
+    t = work->next_task++;
+    pthread_mutex_unlock (&ctx->lock);
+    if (t >= work->num_tasks) break;
+
+    if (ctx->cis_only && ctx->genes != NULL) {
+      for (p = t*CIS_CHUNK; p < (t+1)*CIS_CHUNK && p < ctx->num_genes; p++) {
+	do_cis_gene (w, p);
+      }
+    } else if (ctx->cis_only) {
+      for (p = t*CIS_CHUNK; p < (t+1)*CIS_CHUNK && p < ctx->num_phens; p++) {
+	do_cis_probe (w, p);
+      }
+    } else {
+      do_tile (w, t);
+    }
+  }
+  error_pop (&trap);
+  flush_results (w);
+  return(NULL);
+}
+
+/* Frees the block's work and the scratch of its max_threads workers;
+   fields not yet allocated are NULL */
+static void free_block_work (block_work_t *work, scan_worker_t *workers, int max_threads) {
+  int i;
+
+  for (i=0; i<max_threads; i++) {
+    mem_free(workers[i].tie_counts);
+    mem_free(workers[i].stamp);
+    mem_free(workers[i].cached_p);
+    mem_free(workers[i].cached_flag);
+    mem_free(workers[i].cached_stats);
+    mem_free(workers[i].gt_sums);
+    mem_free(workers[i].gt_stamp);
+    mem_free(workers[i].buf);
+    mem_free(workers[i].buf_stats);
+  }
+  free(workers);
+  if (work->reps != NULL) free(work->reps);
+  if (work->cis_index != NULL) free(work->cis_index);
+  mem_free(work->pre_snps);
+  mem_free(work->inter_snps);
+  free(work);
+}
+
+/*
+ * Tests the block against every probe, appending hits to ctx->results and
+ * adding to the test counts.  SNPs whose dup_rep is another SNP are done
+ * with their representative.  All scratch is allocated before any thread
+ * starts, so going over --mem-limit unwinds with nothing running.
+ */
+void scan_block (scan_ctx_t *ctx, snp_t **block, int num_snps) {
+  block_work_t *work;
+  scan_worker_t *workers;
+  pthread_t *threads;
+  error_trap_t trap;
+  char error[256];
+  int max_threads = ctx->num_threads < 1 ? 1 : ctx->num_threads;
+  int num_threads;
+  int i, k;
+
+  work = MallocOrDie(sizeof(block_work_t));
+  memset (work, 0, sizeof(block_work_t));
+  workers = MallocOrDie(sizeof(scan_worker_t)*max_threads);
+  memset (workers, 0, sizeof(scan_worker_t)*max_threads);
+  error_push (&trap);
+  if (setjmp(trap.env) != 0) {
+    free_block_work (work, workers, max_threads);
+    error_rethrow ();
+  }
+
+  work->ctx = ctx;
+  work->block = block;
+  work->num_snps = num_snps;
+  work->next_task = 0;
+  work->next_prep = 0;
+  work->error[0] = '\0';
+
+  for (k=0; k<num_snps; k++) {
+    block[k]->scan_index = k;
+  }
+  if (ctx->test_type == 2) {
+    work->inter_snps = mem_alloc(MEM_SCRATCH, sizeof(inter_snp_t)*(num_snps+1));
+  }
+
+  if (ctx->cis_only) {
+    work->cis_index = MallocOrDie(sizeof(snp_t *)*(num_snps+1));
+    memcpy (work->cis_index, block, sizeof(snp_t *)*num_snps);
+    qsort (work->cis_index, num_snps, sizeof(snp_t *), &snp_pos_sort_func);
+    if (ctx->genes != NULL) {
+      work->num_tasks = (ctx->num_genes + CIS_CHUNK - 1) / CIS_CHUNK;
+    } else {
+      work->num_tasks = (ctx->num_phens + CIS_CHUNK - 1) / CIS_CHUNK;
+    }
+  } else {
+    work->reps = MallocOrDie(sizeof(snp_t *)*(num_snps+1));
+    work->num_reps = 0;
+    for (k=0; k<num_snps; k++) {
+      if (block[k]->dup_rep == NULL || block[k]->dup_rep == block[k]) {
+	work->reps[work->num_reps++] = block[k];
+      }
+    }
+    if (ctx->prescreen != NULL) {
+      work->pre_snps = mem_alloc(MEM_SCRATCH, sizeof(prescreen_snp_t)*(num_snps+1));
+      for (k=0; k<work->num_reps; k++) {
+	prescreen_snp (&work->pre_snps[work->reps[k]->scan_index], work->reps[k], ctx->num_indivs);
+      }
+    }
+    work->num_stiles = (work->num_reps + ctx->tile_snps - 1) / ctx->tile_snps;
+    work->num_tasks = work->num_stiles * ((ctx->num_phens + ctx->tile_phens - 1) / ctx->tile_phens);
+  }
+
+  num_threads = max_threads < work->num_tasks ? max_threads : work->num_tasks;
+  if (num_threads < 1) num_threads = 1;
+  for (i=0; i<num_threads; i++) {
+    workers[i].work = work;
+    if (ctx->test_type == 0) {
+      workers[i].tie_counts = mem_alloc(MEM_SCRATCH, sizeof(int)*ctx->num_indivs);
+    }
+    if (ctx->cis_only) {
+      workers[i].stamp = mem_alloc(MEM_SCRATCH, sizeof(int)*(num_snps+1));
+      workers[i].cached_p = mem_alloc(MEM_SCRATCH, sizeof(float)*(num_snps+1));
+      workers[i].cached_flag = mem_alloc(MEM_SCRATCH, sizeof(int)*(num_snps+1));
+      workers[i].cached_stats = mem_alloc(MEM_SCRATCH, sizeof(pair_stats_t)*(num_snps+1));
+      for (k=0; k<num_snps; k++) workers[i].stamp[k] = -1;
+      if (ctx->genes != NULL && ctx->test_type == 1) {
+	workers[i].gt_sums = mem_alloc(MEM_SCRATCH, sizeof(regress_gt_t)*(num_snps+1));
+	workers[i].gt_stamp = mem_alloc(MEM_SCRATCH, sizeof(int)*(num_snps+1));
+	for (k=0; k<num_snps; k++) workers[i].gt_stamp[k] = -1;
+      }
+    }
+    workers[i].buf = mem_alloc(MEM_SCRATCH, sizeof(result_t)*RESULT_BUF_SIZE);
+    workers[i].buf_stats = mem_alloc(MEM_SCRATCH, sizeof(pair_stats_t)*RESULT_BUF_SIZE);
+  }
+  error_pop (&trap);
+
+  if (work->inter_snps != NULL) pthread_barrier_init (&work->prep_done, NULL, num_threads);
+  threads = MallocOrDie(sizeof(pthread_t)*num_threads);
+  for (i=0; i<num_threads; i++) {
+    if (pthread_create (&threads[i], NULL, &scan_worker, &workers[i]) != 0) Die("Could not start scan thread\n");
+  }
+  for (i=0; i<num_threads; i++) {
+    pthread_join (threads[i], NULL);
+    ctx->total_tests += workers[i].total_tests;
+    ctx->total_cis_tests += workers[i].total_cis_tests;
+    ctx->screened_out += workers[i].screened_out;
+  }
+  free(threads);
+  if (work->inter_snps != NULL) pthread_barrier_destroy (&work->prep_done);
+
+  strcpy (error, work->error);
+  free_block_work (work, workers, max_threads);
+  if (error[0] != '\0') Fail("%s", error);
+  if (ctx->overflow) Fail("Estimated results off\n");
+}
@@ -0,0 +1,59 @@
+/*
+ * scan.h
+ *
+ * Multithreaded scan of a block of SNPs against all probes.
+ */
+
+#ifndef _scan_h
+#define _scan_h
+
+#include <pthread.h>
+
+#include "structs.h"
+#include "prescreen.h"
+#include "gene.h"
+#include "results.h"
+
+#define RESULT_BUF_SIZE 4096    /* Results a thread holds before flushing */
+
+typedef struct _scan_ctx_t {
+  phen_t **phens;               /* Probes, in list order */
+  int num_phens;
+  int num_indivs;
+  int test_type;                /* 0 = K-W, 1 = linear regression, 2 = interaction */
+  float *covariate;             /* For the interaction test */
+  int *orders;                  /* K-W: nonparam_order() of each probe, num_indivs apiece */
+  int cis_only;
+  int maxdist;
+  int num_threads;
+  int tile_snps;                /* SNPs per tile in the trans scan */
+  int tile_phens;               /* Probes per tile in the trans scan */
+  prescreen_t *prescreen;       /* Trans prescreen, or NULL for none */
+  gene_t *genes;                /* Cis: scan probes a gene at a time, or NULL */
+  int num_genes;
+
+  result_t *results;            /* Shared output, filled under lock */
+  pair_stats_t *stats;          /* Stats of each result, kept apart so the
+				   FDR passes over results stay small */
+  fdr_hist_t *hist;             /* --fdr-hist: counts results as they are
+				   flushed, or NULL */
+  long long tot_results;
+  long long estimated_results;
+  long long total_tests;
+  long long total_cis_tests;
+  long long screened_out;       /* Tests the prescreen ruled out */
+  int overflow;                 /* More results than estimated_results */
+  pthread_mutex_t lock;
+} scan_ctx_t;
+
+int check_cis (snp_t *snp, phen_t *phen, int maxdist);
+
+int snp_pos_sort_func (const void *a, const void *b);
+
+int cis_lower_bound (snp_t **index, int n, int chr, int pos);
+
+void scan_choose_tiles (scan_ctx_t *ctx);
+
+void scan_block (scan_ctx_t *ctx, snp_t **block, int num_snps);
+
+#endif
@@ -31,11 +31,16 @@ typedef struct _snp_t {
   char chr;
   int pos;
   int rs;
+  char *alleles[2];     /* From the .bim file, NULL for .map */
   char *gt;
   char **id_list;
   int num_indivs;
   int num_snps;
   int num_groups;
+  int geno_counts[4];   /* hom, het, other hom, missing */
+  struct _snp_t *dup_rep;   /* First SNP with the same gt, NULL if not deduplicated */
+  struct _snp_t *dup_next;  /* Next SNP with the same gt */
+  int scan_index;           /* Position in the block being scanned */
   struct _snp_t *next;
 } snp_t;
 
@@ -45,9 +50,22 @@ typedef struct _phen_t {
   char chr;
   int start;
   int stop;
+  char *gene;           /* Optional fifth column of the gene list, else NULL */
   struct _phen_t *next;
 } phen_t;
 
+/* Effect summary of a tested pair, from sums the test already has.
+   Regression: slope and its standard error (the g*c term for the
+   interaction test).  K-W/M-W: per genotype group count, mean rank and
+   median expression */
+typedef struct _pair_stats_t {
+  float beta;
+  float se;
+  int n[3];
+  float mean_rank[3];
+  float median[3];
+} pair_stats_t;
+
 typedef struct _result_t {
   snp_t *snp;
   phen_t *phen;
@@ -56,4 +74,17 @@ typedef struct _result_t {
   char good_for_cis;
 } result_t;
 
+/* One expression dataset to scan against the shared genotypes */
+typedef struct _dataset_t {
+  char *gene_list;
+  char *exp_dir;
+  char *out_file;       /* NULL to name it from --out or use stdout */
+} dataset_t;
+
+/* Packed sort key for a result: p plus its index in the results array */
+typedef struct _result_key_t {
+  double p;
+  long long index;
+} result_key_t;
+
 #endif
@@ -0,0 +1,159 @@
+/*
+ * synth.c
+ *
+ * Writes a synthetic eQTL dataset: <prefix>.map/.ped with the given
+ * numbers of SNPs and individuals on three chromosomes, <prefix>.genes
+ * listing the probes, and <prefix>.phen/ with one .phen file per probe.
+ * About 2% of calls are missing, some SNPs repeat their neighbour's
+ * genotypes, and a third of the probes have a cis effect.  Used as the
+ * training workload for profile-guided builds (make pgo).
+ *
+ * Usage: synth <prefix> <snps> <individuals> <probes> [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+
+static char *alleles = "ACGT";
+
+static double gauss (void) {
+  double u, v;
+
+  do {
+    u = drand48();
+  } while (u <= 0.);
+  v = drand48();
+  return(sqrt(-2.*log(u)) * cos(2.*M_PI*v));
+}
+
+int main (int argc, char **argv) {
+  FILE *f;
+  char *fname;
+  signed char *gt;
+  char *a1, *a2;
+  int *chr, *pos;
+  int num_snps, num_indivs, num_probes;
+  int s, i, p, x, lead;
+  double freq, effect, v;
+
+  if (argc < 5) {
+    fprintf (stderr, "Usage: synth <prefix> <snps> <individuals> <probes> [seed]\n");
+    exit(1);
+  }
+  num_snps = atoi(argv[2]);
+  num_indivs = atoi(argv[3]);
+  num_probes = atoi(argv[4]);
+  srand48(argc > 5 ? atol(argv[5]) : 1);
+  if (num_snps < 1 || num_indivs < 3 || num_probes < 1) {
+    fprintf (stderr, "Need at least 1 snp, 3 individuals and 1 probe\n");
+    exit(1);
+  }
+
+  fname = malloc(strlen(argv[1]) + 64);
+  gt = malloc((size_t)num_snps*num_indivs);
+  a1 = malloc(num_snps);
+  a2 = malloc(num_snps);
+  chr = malloc(sizeof(int)*num_snps);
+  pos = malloc(sizeof(int)*num_snps);
+  if (fname == NULL || gt == NULL || a1 == NULL || a2 == NULL || chr == NULL || pos == NULL) {
+    fprintf (stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  /* Genotypes: 0-2 copies of a2, -1 for missing */
+  for (s=0; s<num_snps; s++) {
+    chr[s] = 1 + (int)((3LL*s)/num_snps);
+    pos[s] = 1000*(s+1);
+    a1[s] = alleles[(int)(drand48()*4)];
+    do {
+      a2[s] = alleles[(int)(drand48()*4)];
+    } while (a2[s] == a1[s]);
+    if (s > 0 && drand48() < 0.15) {
+      memcpy (gt + (size_t)s*num_indivs, gt + (size_t)(s-1)*num_indivs, num_indivs);
+      a1[s] = a1[s-1];
+      a2[s] = a2[s-1];
+      continue;
+    }
+    freq = 0.05 + 0.45*drand48();
+    for (i=0; i<num_indivs; i++) {
+      if (drand48() < 0.02) {
+	gt[(size_t)s*num_indivs + i] = -1;
+      } else {
+	gt[(size_t)s*num_indivs + i] = (drand48() < freq) + (drand48() < freq);
+      }
+    }
+    /* Keep every SNP polymorphic */
+    gt[(size_t)s*num_indivs] = 0;
+    gt[(size_t)s*num_indivs + 1] = 1;
+  }
+
+  sprintf (fname, "%s.map", argv[1]);
+  if ((f = fopen(fname, "w")) == NULL) {
+    fprintf (stderr, "Cannot write %s\n", fname);
+    exit(1);
+  }
+  for (s=0; s<num_snps; s++) {
+    fprintf (f, "%d\trs%d\t0\t%d\n", chr[s], s+1, pos[s]);
+  }
+  fclose(f);
+
+  sprintf (fname, "%s.ped", argv[1]);
+  if ((f = fopen(fname, "w")) == NULL) {
+    fprintf (stderr, "Cannot write %s\n", fname);
+    exit(1);
+  }
+  for (i=0; i<num_indivs; i++) {
+    fprintf (f, "FAM%d IND%d 0 0 1 -9", i, i);
+    for (s=0; s<num_snps; s++) {
+      x = gt[(size_t)s*num_indivs + i];
+      if (x < 0) {
+	fprintf (f, " 0 0");
+      } else {
+	fprintf (f, " %c %c", x == 2 ? a2[s] : a1[s], x >= 1 ? a2[s] : a1[s]);
+      }
+    }
+    fprintf (f, "\n");
+  }
+  fclose(f);
+
+  sprintf (fname, "%s.phen", argv[1]);
+  mkdir (fname, 0755);
+  sprintf (fname, "%s.genes", argv[1]);
+  if ((f = fopen(fname, "w")) == NULL) {
+    fprintf (stderr, "Cannot write %s\n", fname);
+    exit(1);
+  }
+  /* Each probe sits over an evenly spaced lead SNP */
+  for (p=0; p<num_probes; p++) {
+    lead = (int)(((long long)p*num_snps)/num_probes);
+    fprintf (f, "PROBE%d\t%d\t%d\t%d\n", p, chr[lead], pos[lead] - 500, pos[lead] + 1500);
+  }
+  fclose(f);
+
+  for (p=0; p<num_probes; p++) {
+    lead = (int)(((long long)p*num_snps)/num_probes);
+    effect = (p % 3 == 0) ? 0.8 : 0.;
+    sprintf (fname, "%s.phen/PROBE%d.phen", argv[1], p);
+    if ((f = fopen(fname, "w")) == NULL) {
+      fprintf (stderr, "Cannot write %s\n", fname);
+      exit(1);
+    }
+    for (i=0; i<num_indivs; i++) {
+      x = gt[(size_t)lead*num_indivs + i];
+      v = gauss() + effect*(x >= 0 ? x : 1);
+      fprintf (f, "FAM%d IND%d\t%.4f\n", i, i, v);
+    }
+    fclose(f);
+  }
+
+  free(fname);
+  free(gt);
+  free(a1);
+  free(a2);
+  free(chr);
+  free(pos);
+  return(0);
+}
@@ -1,8 +1,132 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include "structs.h"
 #include "nonparam.h"
+#include "regress.h"
+#include "prescreen.h"
 
+/*
+ * Regression case for Mann-Whitney with missing calls (group 127) and
+ * ties among the called individuals.  Expected p from the normal
+ * approximation with variance n0*n1*(n+1)/12 - n0*n1*sum(t^3-t)/(12*n*(n-1)):
+ * n = 11, n0 = 5, U = 9.5, sum(t^3-t) = 36.
+ */
+static float check_vals[] = {1., 1., 2., 2., 2., 3., 4., 4., 5., 6., 7., 7., 2., 5.};
+static char check_groups[] = {0, 1, 0, 127, 1, 0, 127, 1, 1, 0, 1, 1, 0, 127};
+#define CHECK_N 14
+#define CHECK_P 0.3086125
+
+static int run_check (void) {
+  int order[CHECK_N];
+  int tie_counts[CHECK_N];
+  int flag;
+  double p;
+
+  nonparam_order (check_vals, CHECK_N, order);
+  p = nonparam_compar (check_vals, check_groups, CHECK_N, 2,
+		       order, tie_counts, &flag, NULL);
+  printf ("%f\t%d\t(expect %f)\n", p, flag, CHECK_P);
+  if (fabs(p - CHECK_P) > 1e-4) {
+    printf ("FAIL\n");
+    return(1);
+  }
+  printf ("ok\n");
+  return(0);
+}
+
+/*
+ * Prescreen case: SNPs with about 2% missing calls, some with two groups
+ * only, against mostly null probes (every fifth tied to rounding, the
+ * first two with an effect of SNP 0).  Every pair the exact test puts at
+ * p <= MAXP must get past the screen, and the screen must still rule out
+ * pairs whose SNP has missing calls.
+ */
+#define PRE_INDIVS 200
+#define PRE_SNPS 60
+#define PRE_PHENS 20
+
+static int run_prescreen_check (int test_type) {
+  static char gts[PRE_SNPS][PRE_INDIVS];
+  static float vals[PRE_PHENS][PRE_INDIVS];
+  snp_t snps[PRE_SNPS];
+  phen_t phens[PRE_PHENS];
+  phen_t *phen_list[PRE_PHENS];
+  prescreen_snp_t ps;
+  prescreen_t *pre;
+  int order[PRE_INDIVS];
+  int tie_counts[PRE_INDIVS];
+  int s, p, i, g, flag, pass;
+  int num_missing, seen[3];
+  int missing_pairs = 0, screened = 0, hits = 0, lost = 0;
+  double exact;
+
+  srand48(7);
+  for (s=0; s<PRE_SNPS; s++) {
+    seen[0] = seen[1] = seen[2] = 0;
+    for (i=0; i<PRE_INDIVS; i++) {
+      g = (drand48() < 0.5) + (drand48() < 0.5);
+      if (s % 4 == 3 && g == 2) g = 1;
+      if (drand48() < 0.02) g = 127;
+      else seen[g] = 1;
+      gts[s][i] = (char)g;
+    }
+    memset (&snps[s], 0, sizeof(snp_t));
+    snps[s].gt = gts[s];
+    snps[s].num_indivs = PRE_INDIVS;
+    snps[s].num_groups = seen[0] + seen[1] + seen[2];
+  }
+  for (p=0; p<PRE_PHENS; p++) {
+    for (i=0; i<PRE_INDIVS; i++) {
+      vals[p][i] = (float)(drand48() + drand48() + drand48() - 1.5);
+      if (p < 2 && gts[0][i] != 127) vals[p][i] += 0.3*gts[0][i];
+      if (p % 5 == 4) vals[p][i] = roundf(4.*vals[p][i]);
+    }
+    memset (&phens[p], 0, sizeof(phen_t));
+    phens[p].values = vals[p];
+    phen_list[p] = &phens[p];
+  }
+
+  pre = prescreen_new (phen_list, PRE_PHENS, PRE_INDIVS, test_type);
+  for (s=0; s<PRE_SNPS; s++) {
+    prescreen_snp (&ps, &snps[s], PRE_INDIVS);
+    num_missing = 0;
+    for (i=0; i<PRE_INDIVS; i++) num_missing += (gts[s][i] == 127);
+    for (p=0; p<PRE_PHENS; p++) {
+      pass = prescreen_pass (pre, p, &ps, &snps[s]);
+      if (test_type == 0) {
+	nonparam_order (vals[p], PRE_INDIVS, order);
+	exact = nonparam_compar (vals[p], gts[s], PRE_INDIVS, snps[s].num_groups,
+				 order, tie_counts, &flag, NULL);
+      } else {
+	exact = regression_significance (gts[s], vals[p], PRE_INDIVS);
+      }
+      if (num_missing > 0) {
+	missing_pairs++;
+	if (!pass) screened++;
+      }
+      if (exact >= 0. && exact <= MAXP) {
+	hits++;
+	if (!pass) lost++;
+      }
+    }
+  }
+  prescreen_free (pre, PRE_PHENS);
+
+  printf ("prescreen %s: %d of %d pairs with missing calls screened out, %d of %d hits lost\n",
+	  test_type == 0 ? "kw" : "reg", screened, missing_pairs, lost, hits);
+  if (lost > 0 || screened == 0 || missing_pairs == 0) {
+    printf ("FAIL\n");
+    return(1);
+  }
+  printf ("ok\n");
+  return(0);
+}
+
+/* With no arguments, runs the regression cases; otherwise reads
+   "group value" lines from argv[1] */
 int main (int argc, char **argv) {
   FILE *f;
   char buf[256];
@@ -13,11 +137,11 @@ int main (int argc, char **argv) {
   int flag;
   int *sort_index;
   int *tie_counts;
-  float *rank;
 
   float p;
+  if (argc < 2) return(run_check() + run_prescreen_check(0) + run_prescreen_check(1));
   f = fopen(argv[1], "r");
-  while (fgets(buf, 255, f)) {
+  while (n < 1000 && fgets(buf, 255, f)) {
     groups[n] = atoi(buf);
     cp = buf;
     while (!isspace(*cp)) cp++;
@@ -28,16 +152,17 @@ int main (int argc, char **argv) {
 
   sort_index = malloc(sizeof(int) * n);
   tie_counts = malloc(sizeof(int)*n);
-  rank = malloc(sizeof(float)*n);
-  if (sort_index == NULL || tie_counts == NULL || rank == NULL) {
+  if (sort_index == NULL || tie_counts == NULL) {
     fprintf (stderr, "Could not alloc\n");
     exit(999);
   }
 
+  nonparam_order (vals, n, sort_index);
   p = nonparam_compar (vals, groups, n,
 		       2, /* num_groups */
-		       sort_index, rank, tie_counts, &flag);
+		       sort_index, tie_counts, &flag, NULL);
 
   printf ("%f\t%d\n", p, flag);
+  return(0);
 }
 